@@ -0,0 +1,69 @@
+#!/usr/bin/env python
+'''
+Times the PorterStemmer extension on a few groups of words. Run it against
+two builds of the module to compare them, e.g.
+
+    python setup.py build_ext --inplace
+    PYTHONPATH=. python helper/benchmark.py
+
+Each line reports the average time per word for one group, stemmed both
+through stem() one call at a time and through stem_many() in one batch,
+and the share of words stem() returned as the very same object, i.e.
+without allocating a new one.
+'''
+
+import sys
+import timeit
+
+from PorterStemmer import stem, stem_many
+
+GROUPS = [
+    # two letters or less are never stemmed, so this is the cost of the call
+    ('call', ['a', 'an', 'as', 'at', 'be', 'by', 'do', 'go', 'if', 'in']),
+    # nothing to strip; stem() hands the word itself back
+    ('unchanged', ['run', 'tree', 'sky', 'box', 'cat', 'word', 'fish', 'green',
+                   'time', 'dog']),
+    # step1 only; m() is barely consulted
+    ('short', ['cats', 'runs', 'ponies', 'caresses', 'feed', 'hop',
+               'tree', 'box', 'sky', 'meetings']),
+    # -ed/-ing plus step5, each calls m() a few times
+    ('step1b', ['hopping', 'agreed', 'disabled', 'matting', 'mating',
+                'meeting', 'milling', 'messing', 'filing', 'controlled']),
+    # long suffix chains that go through r() in step2/3, step4 and step5
+    ('m-heavy', ['generalizations', 'operationally', 'rationalization',
+                 'conditionalities', 'electricalness', 'hopefulness',
+                 'sensibilities', 'adjustmentalism', 'formalizations',
+                 'communicativeness']),
+]
+
+REPEAT = 5
+ROUNDS = 2000
+
+
+def per_word_ns(stmt, words, rounds):
+    best = min(timeit.repeat(stmt, number=rounds, repeat=REPEAT))
+    return best * 1e9 / (rounds * len(words))
+
+
+def main():
+    print('%-10s %12s %12s %8s' % ('group', 'stem() ns', 'stem_many ns',
+                                   'shared'))
+    for name, words in GROUPS:
+        words = words * 10
+
+        def single():
+            for w in words:
+                stem(w)
+
+        def batch():
+            stem_many(words)
+
+        shared = sum(1 for w in words if stem(w) is w) / float(len(words))
+        print('%-10s %12.1f %12.1f %7.0f%%' % (name,
+                                               per_word_ns(single, words, ROUNDS),
+                                               per_word_ns(batch, words, ROUNDS),
+                                               shared * 100))
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -1,86 +1,53 @@
 /*
-    Original Comment:
- 
-    This is the Porter stemming algorithm, coded up as thread-safe ANSI C
-    by the author.
-    
-    It may be be regarded as cononical, in that it follows the algorithm
-    presented in
-    
-    Porter, 1980, An algorithm for suffix stripping, Program, Vol. 14,
-    no. 3, pp 130-137,
-    
-    only differing from it at the points maked --DEPARTURE-- below.
-    
-    See also http://www.tartarus.org/~martin/PorterStemmer
-    
-    The algorithm as described in the paper could be exactly replicated
-    by adjusting the points of DEPARTURE, but this is barely necessary,
-    because (a) the points of DEPARTURE are definitely improvements, and
-    (b) no encoding of the Porter stemmer I have seen is anything like
-    as exact as this version, even with the points of DEPARTURE!
-    
-    You can compile it on Unix with 'gcc -O3 -o stem stem.c' after which
-    'stem' takes a list of inputs and sends the stemmed equivalent to
-    stdout.
-    
-    The algorithm as encoded here is particularly fast.
-    
-    Release 2 (the more old-fashioned, non-thread-safe version may be
-    regarded as release 1.)
-
-    --------------------------------------------------------------------
-    
-    $KB: This has been modified fairly heavily to work as a python extension.
-    
-    The functions have been updated to work with Py_UNICODE character types
-    instead of chars. This adds complexity, as Python's Py_UNICODE may or may
-    not be binary compatable with wchar_t. See http://docs.python.org/api/unicodeObjects.html
-    for more info.
-    
-    To be portable, all static strings need to be generated as arrays of
-    Py_UNICODE. This can be seen by the abundance of lines like:
-    
-    static const Py_UNICODE step4_al[] = {2, 'a','l', '\0'};
-
+    $KB: the PorterStemmer extension. This is the Python binding around the
+    stemming kernel in porter_stemmer_core.cpp: it reads a str in whichever
+    PEP 393 form it is stored (Py_UCS1, Py_UCS2 or Py_UCS4) or a bytes
+    object in place, hands the code units to the kernel through
+    porter_stemmer.h and builds the results, and it keeps everything that is
+    the module's own, the stopwords, the stem cache, stem_many's threads,
+    Vocabulary and the text scanner of stem_text.
 */
 
 #include <Python.h>  /* -PY- */
+#include <stdio.h>   /* for printf */
 #include <stdlib.h>  /* for malloc, free */
 #include <string.h>  /* for memcmp, memmove */
-#include <set>
-
-/*  You will probably want to move the following declarations to a central
-    header file.
-*/
-
-#define __U__ (Py_UNICODE)
-
-size_t pyunicode_slen(const Py_UNICODE* p_str)
-{
-    const Py_UNICODE* p_end = p_str;
-    while(*p_end++);
-    return (p_end - p_str - 1);
-}
-
-int pyunicode_strcmp (const Py_UNICODE* p_src, const Py_UNICODE* p_dst)
+#include <stdint.h>  /* for uint64_t */
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <new>      /* for std::bad_alloc */
+#include <algorithm>
+#include <limits.h> /* for INT_MAX */
+#include <errno.h>
+#include <string>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>   /* for mapping stopword images */
+#include <sys/stat.h>
+#define STOPWORD_MMAP 1
+#endif
+
+#include "porter_stemmer.h"
+#include "porter_stemmer_capi.h"
+#include "porter_stemmer_internal.h"
+
+#if PY_VERSION_HEX < 0x03070000
+#error "PorterStemmer needs Python 3.7 or later"
+#endif
+
+/* every str is ready from 3.12 on, where PyUnicode_READY is deprecated */
+#if PY_VERSION_HEX >= 0x030C0000
+#define STEMMER_UNICODE_READY(op) 0
+#else
+#define STEMMER_UNICODE_READY(op) PyUnicode_READY(op)
+#endif
+
+/* pyunicode_print(p_str) prints a zero terminated word, for dump_stopwords */
+
+void pyunicode_print(const Py_UCS4* p_str)
 {
-    int ret = 0;
-
-    while( ! (ret = *p_src - *p_dst) && *p_dst)
-        ++p_src, ++p_dst;
-
-    if ( ret < 0 )
-        ret = -1;
-    else if ( ret > 0 )
-        ret = 1;
-
-    return( ret );
-}
-
-void pyunicode_print(const Py_UNICODE* p_str)
-{
-    const Py_UNICODE* p_end = p_str;
+    const Py_UCS4* p_end = p_str;
     while(*p_end)
     {
         printf("%c", (char)*p_end);
@@ -88,549 +55,816 @@ void pyunicode_print(const Py_UNICODE* p_str)
     }
 }
 
-struct stemmer;
-
-struct lesswstr
+/*  $KB: stopwords are kept in an open addressing hash table. All of the
+    words are stored back to back in a single arena, each as its length, its
+    code units and a zero, and each slot packs a word's hash (high half) and
+    its offset in the arena (low half) into one atomic word. Slots are
+    probed linearly and the table is kept at most half full, tombstones
+    included, so a lookup is one pass to hash the word and, almost always, a
+    single compare.
+
+    add_stopwords and remove_stopwords change a table in place while that
+    fits. A new word is written to the unused end of the arena, where no
+    reader looks, before its slot is stored; a removed word's slot becomes a
+    tombstone. Either way it is a single atomic store, so a lookup on another
+    thread sees a slot before or after the change, never half of it. The
+    arena and the slots are sized when a table is built and never move; an
+    addition that doesn't fit builds a bigger table and swaps it in, see
+    the RCU notes below. Removed words stay in the arena until then. */
+
+#define STOPWORD_EMPTY 0xffffffffu
+#define STOPWORD_TOMBSTONE 0xfffffffeu
+#define STOPWORD_MAX_ARENA 0xfffffff0u  /* offsets stay clear of the markers */
+
+/* room left for later additions when a table is built: a quarter more */
+#define STOPWORD_HEADROOM(n) ((n) + (n) / 4 + 16)
+
+static inline uint64_t make_slot(unsigned int hash, unsigned int offset)
 {
-    bool operator()(const Py_UNICODE* s1, const Py_UNICODE* s2) const
-    {
-        return pyunicode_strcmp(s1, s2) < 0;
-    }
-};
-
-typedef std::set<const Py_UNICODE*, lesswstr> StopwordSet;
-static StopwordSet g_stopwords;
-
-extern struct stemmer * create_stemmer(void);
-extern void free_stemmer(struct stemmer * z);
+    return ((uint64_t)hash << 32) | offset;
+}
 
-extern int stem(struct stemmer * z, Py_UNICODE * b, int k);
+static inline unsigned int slot_hash(uint64_t slot) { return (unsigned int)(slot >> 32); }
+static inline unsigned int slot_offset(uint64_t slot) { return (unsigned int)slot; }
 
+/*  A table's memory is either its own or part of a stopword image mapped
+    from a file, see load_stopwords below. */
 
-/* The main part of the stemming algorithm starts here.
-*/
+struct StopwordTable
+{
+    Py_UCS4* arena;                 /* sized when built, never reallocated */
+    size_t arena_size;
+    size_t arena_used;
+    std::atomic<uint64_t>* slots;   /* none, or a power of two of them */
+    size_t num_slots;
+    std::atomic<size_t> count;      /* live words */
+    size_t used;                    /* slots holding a word or a tombstone */
+
+    std::vector<Py_UCS4> arena_store;
+    std::vector<std::atomic<uint64_t> > slot_store;
+    void* p_map;                    /* the mapped image, or NULL */
+    size_t map_len;
+    std::vector<uint64_t> image_store;  /* the image read in, without mmap */
+
+    StopwordTable() : arena(NULL), arena_size(0), arena_used(0), slots(NULL), num_slots(0),
+                      count(0), used(0), p_map(NULL), map_len(0) {}
+    ~StopwordTable();
+};
 
-#define TRUE 1
-#define FALSE 0
+/*  $KB: the table is published RCU style, so a new one can go in while
+    other threads are still reading the old. g_stopwords always points at a
+    complete table; set_stopwords, or add_stopwords outgrowing the table,
+    builds the replacement off to the side, swaps the pointer, and frees the
+    old table only once every reader that might have seen it is done.
+
+    Code holding the GIL reads the table through stopwords_gil() with a
+    plain load: the pointer is only swapped with the GIL held and a lookup
+    never lets go of it, so such a reader can't overlap a swap. Anything
+    else, the C API in particular, brackets its lookups with
+    stopword_read_lock/unlock, which count it in under the parity of the
+    current epoch. After a swap the writer flips the epoch and waits, with
+    the GIL released, for the old parity's count to drain; readers arriving
+    meanwhile count under the new parity and already see the new table.
+    Readers never wait for anything. */
+
+struct alignas(64) stopword_readers
+{
+    std::atomic<long> count;    /* one cache line each, they are hot */
+};
 
-/* stemmer is a structure for a few local bits of data,
-*/
+static StopwordTable g_no_stopwords;
+static std::atomic<StopwordTable*> g_stopwords(&g_no_stopwords);
+static std::atomic<unsigned> g_stopword_epoch(0);
+static stopword_readers g_stopword_readers[2];
+static std::mutex g_stopword_writer;    /* one change to the stopwords at a time */
 
-struct stemmer {
-    Py_UNICODE * b;    /* buffer for word to be stemmed */
-    int k;          /* offset to the end of the string */
-    int j;          /* a general offset into the string */
-};
+static inline StopwordTable* stopwords_gil()
+{
+    return g_stopwords.load(std::memory_order_acquire);
+}
 
+/*  stopword_read_lock(&parity) returns the current table, which stays valid
+    until the matching stopword_read_unlock(parity). */
 
-/*  Member b is a buffer holding a word to be stemmed. The letters are in
-    b[0], b[1] ... ending at b[z->k]. Member k is readjusted downwards as
-    the stemming progresses. Zero termination is not in fact used in the
-    algorithm.
+static inline StopwordTable* stopword_read_lock(unsigned* p_parity)
+{
+    unsigned parity;
+    while (true)
+    {
+        parity = g_stopword_epoch.load() & 1;
+        g_stopword_readers[parity].count.fetch_add(1);
+        /* a flip in between may have missed us; count in again */
+        if ((g_stopword_epoch.load() & 1) == parity)
+            break;
+        g_stopword_readers[parity].count.fetch_sub(1);
+    }
+    *p_parity = parity;
+    return g_stopwords.load();
+}
 
-    Note that only lower case sequences are stemmed. Forcing to lower case
-    should be done before stem(...) is called.
+static inline void stopword_read_unlock(unsigned parity)
+{
+    g_stopword_readers[parity].count.fetch_sub(1, std::memory_order_release);
+}
 
+/*  stopword_publish(p_table) makes p_table the stopword table and returns
+    the one it replaces; the caller holds the GIL and g_stopword_writer.
+    stopword_synchronize() then waits until no reader can still be using
+    the old table; call it without the GIL. */
 
-    Typical usage is:
+static StopwordTable* stopword_publish(StopwordTable* p_table)
+{
+    return g_stopwords.exchange(p_table);
+}
 
-        struct stemmer * z = create_stemmer();
-        Py_UNICODE b[] = "pencils";
-        int res = stem(z, b, 6);
-            /- stem the 7 characters of b[0] to b[6]. The result, res,
-               will be 5 (the 's' is removed). -/
-        free_stemmer(z);
-*/
+static void stopword_synchronize()
+{
+    unsigned parity = g_stopword_epoch.fetch_add(1) & 1;
+    while (g_stopword_readers[parity].count.load(std::memory_order_acquire) != 0)
+        std::this_thread::yield();
+}
 
+/*  FNV-1a over the code units of str. It only depends on their values, so a
+    word hashes the same whatever width it is stored at. */
 
-extern struct stemmer * create_stemmer(void)
+template <typename CharT>
+static unsigned int stopword_hash(const CharT* str, size_t len)
 {
-    return new stemmer;
-    /* assume malloc succeeds */
+    unsigned int hash = 2166136261u;
+    for ( size_t i = 0; i < len; ++i )
+    {
+        hash ^= (unsigned int)str[i];
+        hash *= 16777619u;
+    }
+    return hash;
 }
 
-extern void free_stemmer(stemmer * z)
+template <typename CharT>
+static bool same_chars(const Py_UCS4* p_word, const CharT* str, size_t len)
 {
-    delete z;
+    for ( size_t i = 0; i < len; ++i )
+        if (p_word[i] != str[i])
+            return false;
+    return true;
 }
 
+static inline bool same_chars(const Py_UCS4* p_word, const Py_UCS4* str, size_t len)
+{
+    return memcmp(p_word, str, len * sizeof(Py_UCS4)) == 0;
+}
 
-/*  cons(z, i) is TRUE <=> b[i] is a consonant. ('b' means 'z->b', but here
-    and below we drop 'z->' in comments.
-*/
+/*  stopword_find(p_table, str, len, hash) returns the index of the slot
+    holding str, or -1. The table must have slots. */
 
-static int cons(struct stemmer * z, int i)
+template <typename CharT>
+static ptrdiff_t stopword_find(const StopwordTable* p_table, const CharT* str, size_t len, unsigned int hash)
 {
-    switch (z->b[i])
+    size_t mask = p_table->num_slots - 1;
+    for ( size_t idx = hash & mask; ; idx = (idx + 1) & mask )
     {
-        case __U__'a': case __U__'e': case __U__'i': case __U__'o': case __U__'u': return FALSE;
-        case __U__'y': return (i == 0) ? TRUE : !cons(z, i - 1);
-        default: return TRUE;
+        uint64_t slot = p_table->slots[idx].load(std::memory_order_acquire);
+        unsigned int offset = slot_offset(slot);
+        if (offset == STOPWORD_EMPTY)
+            return -1;
+        if (offset != STOPWORD_TOMBSTONE && slot_hash(slot) == hash && p_table->arena[offset] == len &&
+            same_chars(&p_table->arena[offset + 1], str, len))
+            return (ptrdiff_t)idx;
     }
 }
 
-/*  m(z) measures the number of consonant sequences between 0 and j. if c is
-    a consonant sequence and v a vowel sequence, and <..> indicates arbitrary
-    presence,
+template <typename CharT>
+static bool is_stopword(const StopwordTable* p_table, const CharT* str, size_t len)
+{
+    if (p_table->count.load(std::memory_order_relaxed) == 0)
+        return false;
+    return stopword_find(p_table, str, len, stopword_hash(str, len)) >= 0;
+}
+
+/*  stopword_new(num_words, arena_len) returns an empty table with room for
+    num_words words taking arena_len code units in all, two more than its
+    length per word; NULL if there is no memory. */
 
-        <c><v>       gives 0
-        <c>vc<v>     gives 1
-        <c>vcvc<v>   gives 2
-        <c>vcvcvc<v> gives 3
-        ....
-*/
+static StopwordTable* stopword_new(size_t num_words, size_t arena_len)
+{
+    if (arena_len > STOPWORD_MAX_ARENA)
+        return NULL;
+    StopwordTable* p_table = new (std::nothrow) StopwordTable;
+    if (p_table == NULL)
+        return NULL;
 
-static int m(struct stemmer * z)
-{  
-    int n = 0;
-    int i = 0;
-    int j = z->j;
-    while(TRUE)
-    {
-        if (i > j) return n;
-        if (! cons(z, i)) break; i++;
-    }
-    i++;
-    while(TRUE)
-    {  
-        while(TRUE)
-        {  
-            if (i > j) return n;
-            if (cons(z, i)) break;
-            i++;
-        }
-        i++;
-        n++;
-        while(TRUE)
-        {
-            if (i > j) return n;
-            if (! cons(z, i)) break;
-            i++;
-        }
-        i++;
+    size_t num_slots = 8;
+    while (num_slots < 2 * num_words)
+        num_slots <<= 1;
+    try
+    {
+        std::vector<std::atomic<uint64_t> >(num_slots).swap(p_table->slot_store);
+        p_table->arena_store.resize(arena_len);
     }
+    catch (const std::bad_alloc&)
+    {
+        delete p_table;
+        return NULL;
+    }
+    p_table->slots = p_table->slot_store.data();
+    p_table->num_slots = num_slots;
+    p_table->arena = p_table->arena_store.data();
+    p_table->arena_size = arena_len;
+    for ( size_t idx = 0; idx < num_slots; ++idx )
+        p_table->slots[idx].store(make_slot(0, STOPWORD_EMPTY), std::memory_order_relaxed);
+    return p_table;
 }
 
-/* vowelinstem(z) is TRUE <=> 0,...j contains a vowel */
+/* stopword_fits(p_table, len) is TRUE <=> a word of len code units can be
+   added without outgrowing the table */
 
-static int vowelinstem(struct stemmer * z)
+static bool stopword_fits(const StopwordTable* p_table, size_t len)
 {
-    int j = z->j;
-    int i; for (i = 0; i <= j; i++) if (! cons(z, i)) return TRUE;
-    return FALSE;
+    return 2 * (p_table->used + 1) <= p_table->num_slots &&
+           p_table->arena_used + len + 2 <= p_table->arena_size;
 }
 
-/* doublec(z, j) is TRUE <=> j,(j-1) contain a double consonant. */
+/*  stopword_insert(p_table, str, len) adds str, which must fit, unless it is
+    there already; returns TRUE if it was added. */
 
-static int doublec(struct stemmer * z, int j)
+template <typename CharT>
+static bool stopword_insert(StopwordTable* p_table, const CharT* str, size_t len)
 {
-    Py_UNICODE * b = z->b;
-    if (j < 1) return FALSE;
-    if (b[j] != b[j - 1]) return FALSE;
-    return cons(z, j);
+    unsigned int hash = stopword_hash(str, len);
+    if (stopword_find(p_table, str, len, hash) >= 0)
+        return false;
+
+    size_t offset = p_table->arena_used;
+    Py_UCS4* p_word = &p_table->arena[offset];
+    p_word[0] = (Py_UCS4)len;
+    for ( size_t i = 0; i < len; ++i )
+        p_word[1 + i] = str[i];
+    p_word[1 + len] = 0;
+    p_table->arena_used += len + 2;
+
+    /* the first free slot, reusing a tombstone if there is one */
+    size_t mask = p_table->num_slots - 1;
+    size_t idx = hash & mask;
+    uint64_t slot;
+    while (slot_offset(slot = p_table->slots[idx].load(std::memory_order_relaxed)) < STOPWORD_TOMBSTONE)
+        idx = (idx + 1) & mask;
+    if (slot_offset(slot) == STOPWORD_EMPTY)
+        ++p_table->used;
+    p_table->slots[idx].store(make_slot(hash, (unsigned int)offset), std::memory_order_release);
+    p_table->count.store(p_table->count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    return true;
 }
 
-/*  cvc(z, i) is TRUE <=> i-2,i-1,i has the form consonant - vowel - consonant
-    and also if the second c is not w,x or y. this is used when trying to
-    restore an e at the end of a short word. e.g.
+/* stopword_erase(p_table, str, len) removes str; TRUE if it was there */
 
-        cav(e), lov(e), hop(e), crim(e), but
-        snow, box, tray.
+template <typename CharT>
+static bool stopword_erase(StopwordTable* p_table, const CharT* str, size_t len)
+{
+    if (p_table->count.load(std::memory_order_relaxed) == 0)
+        return false;
+    ptrdiff_t idx = stopword_find(p_table, str, len, stopword_hash(str, len));
+    if (idx < 0)
+        return false;
+    p_table->slots[idx].store(make_slot(0, STOPWORD_TOMBSTONE), std::memory_order_release);
+    p_table->count.store(p_table->count.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+    return true;
+}
 
-*/
+/*  stopword_grow(p_table, num_words, arena_len) returns a new table of
+    p_table's live words, with room for twice them plus num_words more words
+    of arena_len code units; NULL if there is no memory. Tombstones and
+    removed words are left behind. */
 
-static int cvc(struct stemmer * z, int i)
-{  
-    if (i < 2 || !cons(z, i) || cons(z, i - 1) || !cons(z, i - 2)) return FALSE;
+static StopwordTable* stopword_grow(const StopwordTable* p_table, size_t num_words, size_t arena_len)
+{
+    size_t live_arena = 0;
+    for ( size_t idx = 0; idx < p_table->num_slots; ++idx )
     {
-        int ch = z->b[i];
-        if (ch  == __U__'w' || ch == __U__'x' || ch == __U__'y') return FALSE;
+        unsigned int offset = slot_offset(p_table->slots[idx].load(std::memory_order_relaxed));
+        if (offset < STOPWORD_TOMBSTONE)
+            live_arena += p_table->arena[offset] + 2;
     }
-    return TRUE;
-}
-
-/* ends(z, s) is TRUE <=> 0,...k ends with the string s. */
 
-static int ends(struct stemmer * z, const Py_UNICODE * s)
-{  
-    int length = s[0];
-    Py_UNICODE * b = z->b;
-    int k = z->k;
-    if (s[length] != b[k]) return FALSE; /* tiny speed-up */
-    if (length > k + 1) return FALSE;
-    if (memcmp(b + k - length + 1, s + 1, length * sizeof(Py_UNICODE)) != 0) return FALSE;
-    z->j = k-length;
-    return TRUE;
+    StopwordTable* p_new = stopword_new(2 * p_table->count.load() + num_words, 2 * live_arena + arena_len);
+    if (p_new == NULL)
+        return NULL;
+    for ( size_t idx = 0; idx < p_table->num_slots; ++idx )
+    {
+        unsigned int offset = slot_offset(p_table->slots[idx].load(std::memory_order_relaxed));
+        if (offset < STOPWORD_TOMBSTONE)
+            stopword_insert(p_new, &p_table->arena[offset + 1], p_table->arena[offset]);
+    }
+    return p_new;
 }
 
-/* setto(z, s) sets (j+1),...k to the characters in the string s, readjusting
-    k. */
+/*  $KB: a stopword image is a table written out as it sits in memory, so
+    that it can be mapped and used in place: no parsing, no copying, and the
+    pages are shared by every process that maps the file, forked workers
+    included. save_stopwords writes one and load_stopwords maps it. The
+    layout is
 
-static void setto(struct stemmer * z, const Py_UNICODE * s)
-{  
-    int length = s[0];
-    int j = z->j;
-    memmove(z->b + j + 1, s + 1, length * sizeof(Py_UNICODE));
-    z->k = j+length;
-}
+        stopword_image_header
+        num_slots slots         uint64_t, hash << 32 | arena offset
+        arena_len code units    uint32_t, length, characters, 0 per word
 
-/* r(z, s) is used further down. */
+    in native byte order, with the slots and the arena at the offsets the
+    header gives, each aligned for its type. byte_order catches an image
+    from a machine of the other endianness, and version one from a build
+    that hashes or lays out words differently.
 
-static void r(struct stemmer * z, const Py_UNICODE * s) { if (m(z) > 0) setto(z, s); }
+    The image is mapped private and writable: remove_stopwords can still
+    tombstone a slot in place, which copies just that page, while untouched
+    pages stay shared. A word that doesn't fit goes to a new table as
+    usual. */
 
-/*  $KB: splitting step1ab into two functions--one to deal with pluralization,
-    the other for the rest. This is a stop-gap measure before handling word
-    forms in a generic way. */
+#define STOPWORD_IMAGE_VERSION 1
+#define STOPWORD_BYTE_ORDER 0x01020304u
 
-/* step1a(z) gets rid of plurals e.g.
+static const char STOPWORD_IMAGE_MAGIC[8] = {'P', 'S', 'T', 'O', 'P', 'W', 'D', 0};
 
-        caresses  ->  caress
-        ponies    ->  poni
-        ties      ->  ti
-        caress    ->  caress
-        cats      ->  cat
-        meetings  ->  meeting
-*/
+struct stopword_image_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t num_slots;
+    uint64_t slots_offset;
+    uint64_t arena_len;
+    uint64_t arena_offset;
+};
 
+static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t), "slots are mapped as plain uint64_t");
+static_assert(sizeof(Py_UCS4) == sizeof(uint32_t), "the arena is mapped as plain uint32_t");
 
-unsigned short a[] = {'t', 'e', 's', 't'};
+StopwordTable::~StopwordTable()
+{
+#ifdef STOPWORD_MMAP
+    if (p_map != NULL)
+        munmap(p_map, map_len);
+#endif
+}
 
-static const Py_UNICODE step1a_sses[] = {4, 's', 's', 'e', 's', '\0'};
-static const Py_UNICODE step1a_ies[]  = {3, 'i', 'e', 's', '\0'};
-static const Py_UNICODE step1a_i[]    = {1, 'i', '\0'};
+/*  stopword_image(p_table, p_file) writes p_table to p_file as an image; 0,
+    or -1 with errno set. Tombstones are written as they are. */
 
-static void step1a(struct stemmer * z)
+static int stopword_image(const StopwordTable* p_table, FILE* p_file)
 {
-    Py_UNICODE * b = z->b;
-    if (b[z->k] == __U__'s')
+    stopword_image_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, STOPWORD_IMAGE_MAGIC, sizeof(header.magic));
+    header.version = STOPWORD_IMAGE_VERSION;
+    header.byte_order = STOPWORD_BYTE_ORDER;
+    header.num_slots = p_table->num_slots;
+    header.slots_offset = sizeof(header);
+    header.arena_len = p_table->arena_used;
+    header.arena_offset = header.slots_offset + p_table->num_slots * sizeof(uint64_t);
+
+    if (fwrite(&header, sizeof(header), 1, p_file) != 1)
+        return -1;
+    for ( size_t idx = 0; idx < p_table->num_slots; ++idx )
     {
-        if (ends(z, step1a_sses)) z->k -= 2; else
-        if (ends(z, step1a_ies)) setto(z, step1a_i); else
-        if (b[z->k - 1] != __U__'s') z->k--;
+        uint64_t slot = p_table->slots[idx].load(std::memory_order_relaxed);
+        if (fwrite(&slot, sizeof(slot), 1, p_file) != 1)
+            return -1;
     }
+    if (p_table->arena_used > 0 &&
+        fwrite(p_table->arena, sizeof(Py_UCS4), p_table->arena_used, p_file) != p_table->arena_used)
+        return -1;
+    return 0;
 }
 
-/* step1b(z) gets rid of -ed or -ing. e.g.
+/*  stopword_from_image(p_table, p_image, len) points p_table at the image
+    p_image[0] ... p_image[len-1], which must be 8 byte aligned. Returns
+    FALSE if it is not a valid image. Every slot is checked to point at a
+    zero terminated word that lies inside the arena and hashes to it, and at least half
+    the slots must be empty, so no image can make a lookup misbehave; that
+    reads the whole image once, but without copying or writing any of it. */
 
-        feed      ->  feed
-        agreed    ->  agree
-        disabled  ->  disable
+static bool stopword_from_image(StopwordTable* p_table, char* p_image, size_t len)
+{
+    stopword_image_header header;
+    if (len < sizeof(header))
+        return false;
+    memcpy(&header, p_image, sizeof(header));
+    if (memcmp(header.magic, STOPWORD_IMAGE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != STOPWORD_IMAGE_VERSION || header.byte_order != STOPWORD_BYTE_ORDER)
+        return false;
+
+    uint64_t num_slots = header.num_slots;
+    if ((num_slots & (num_slots - 1)) != 0 || header.slots_offset % sizeof(uint64_t) != 0 ||
+        header.slots_offset > len || num_slots > (len - header.slots_offset) / sizeof(uint64_t))
+        return false;
+    uint64_t arena_len = header.arena_len;
+    if (arena_len > STOPWORD_MAX_ARENA || header.arena_offset % sizeof(Py_UCS4) != 0 ||
+        header.arena_offset > len || arena_len > (len - header.arena_offset) / sizeof(Py_UCS4))
+        return false;
+
+    const uint64_t* slots = (const uint64_t*)(p_image + header.slots_offset);
+    const Py_UCS4* arena = (const Py_UCS4*)(p_image + header.arena_offset);
+    size_t count = 0;
+    size_t used = 0;
+    for ( size_t idx = 0; idx < num_slots; ++idx )
+    {
+        unsigned int offset = slot_offset(slots[idx]);
+        if (offset == STOPWORD_EMPTY)
+            continue;
+        ++used;
+        if (offset == STOPWORD_TOMBSTONE)
+            continue;
+        /* the length, the code units and the zero must all fit */
+        if ((uint64_t)offset + 2 > arena_len || arena[offset] > arena_len - offset - 2 ||
+            arena[offset + 1 + arena[offset]] != 0 ||
+            stopword_hash(arena + offset + 1, arena[offset]) != slot_hash(slots[idx]))
+            return false;
+        ++count;
+    }
+    if (2 * used > num_slots)
+        return false;
+
+    p_table->slots = (std::atomic<uint64_t>*)(p_image + header.slots_offset);
+    p_table->num_slots = num_slots;
+    p_table->arena = (Py_UCS4*)(p_image + header.arena_offset);
+    p_table->arena_size = arena_len;
+    p_table->arena_used = arena_len;
+    p_table->count.store(count, std::memory_order_relaxed);
+    p_table->used = used;
+    return true;
+}
 
-        matting   ->  mat
-        mating    ->  mate
-        meeting   ->  meet
-        milling   ->  mill
-        messing   ->  mess
-*/
+/*  utf8_decode(p, end, p_out) decodes the UTF-8 in p ... end-1 to p_out,
+    which has room for end - p code points, and returns how many there
+    were, or -1 for anything that isn't strict UTF-8 (overlong forms,
+    surrogates and code points past 0x10ffff included). */
 
-static const Py_UNICODE step1b_eed[]  = {3, 'e', 'e', 'd', '\0'};
-static const Py_UNICODE step1b_ed[]   = {2, 'e', 'd', '\0'};
-static const Py_UNICODE step1b_ing[]  = {3, 'i', 'n', 'g', '\0'};
-static const Py_UNICODE step1b_at[]   = {2, 'a', 't', '\0'};
-static const Py_UNICODE step1b_ate[]  = {3, 'a', 't', 'e', '\0'};
-static const Py_UNICODE step1b_bl[]   = {2, 'b', 'l', '\0'};
-static const Py_UNICODE step1b_ble[]  = {3, 'b', 'l', 'e', '\0'};
-static const Py_UNICODE step1b_iz[]   = {2, 'i', 'z', '\0'};
-static const Py_UNICODE step1b_ize[]  = {3, 'i', 'z', 'e', '\0'};
-static const Py_UNICODE step1b_e[]    = {1, 'e', '\0'};
-
-static void step1b(struct stemmer * z)
-{
-    Py_UNICODE * b = z->b;
-    if (ends(z, step1b_eed)) { if (m(z) > 0) z->k--; } else
-    if ((ends(z, step1b_ed) || ends(z, step1b_ing)) && vowelinstem(z))
-    {
-        z->k = z->j;
-        if (ends(z, step1b_at)) setto(z, step1b_ate); else
-        if (ends(z, step1b_bl)) setto(z, step1b_ble); else
-        if (ends(z, step1b_iz)) setto(z, step1b_ize); else
-        if (doublec(z, z->k))
+static ptrdiff_t utf8_decode(const unsigned char* p, const unsigned char* end, Py_UCS4* p_out)
+{
+    ptrdiff_t n = 0;
+    while (p < end)
+    {
+        Py_UCS4 ch = *p++;
+        int extra;
+        Py_UCS4 min;
+        if (ch < 0x80)
         {
-            z->k--;
-            {
-                int ch = b[z->k];
-                if (ch == __U__'l' || ch == __U__'s' || ch == __U__'z') z->k++;
-            }
+            p_out[n++] = ch;
+            continue;
         }
-        else if (m(z) == 1 && cvc(z, z->k)) setto(z, step1b_e);
-    }
-}
-
-/* step1c(z) turns terminal y to i when there is another vowel in the stem. */
-
-static const Py_UNICODE step1c_y[]    = {1, 'y', '\0'};
-
-static void step1c(struct stemmer * z)
-{
-    if (ends(z, step1c_y) && vowelinstem(z)) z->b[z->k] = __U__'i';
-}
-
-
-/*  step2(z) maps double suffices to single ones. so -ization ( = -ize plus
-    -ation) maps to -ize etc. note that the string before the suffix must give
-    m(z) > 0. */
-
-static const Py_UNICODE step2_ational[] = {7, 'a','t','i','o','n','a','l', '\0'};
-static const Py_UNICODE step2_ate[] = {3, 'a','t','e', '\0'};
-static const Py_UNICODE step2_tional[] = {6, 't','i','o','n','a','l', '\0'};
-static const Py_UNICODE step2_tion[] = {4, 't','i','o','n', '\0'};
-static const Py_UNICODE step2_enci[] = {4, 'e','n','c','i', '\0'};
-static const Py_UNICODE step2_ence[] = {4, 'e','n','c','e', '\0'};
-static const Py_UNICODE step2_anci[] = {4, 'a','n','c','i', '\0'};
-static const Py_UNICODE step2_ance[] = {4, 'a','n','c','e', '\0'};
-static const Py_UNICODE step2_izer[] = {4, 'i','z','e','r', '\0'};
-static const Py_UNICODE step2_ize[] = {3, 'i','z','e', '\0'};
-static const Py_UNICODE step2_bli[] = {3, 'b','l','i', '\0'};
-static const Py_UNICODE step2_ble[] = {3, 'b','l','e', '\0'};
-static const Py_UNICODE step2_abli[] = {4, 'a','b','l','i', '\0'};
-static const Py_UNICODE step2_able[] = {4, 'a','b','l','e', '\0'};
-static const Py_UNICODE step2_alli[] = {4, 'a','l','l','i', '\0'};
-static const Py_UNICODE step2_al[] = {2, 'a','l', '\0'};
-static const Py_UNICODE step2_entli[] = {5, 'e','n','t','l','i', '\0'};
-static const Py_UNICODE step2_ent[] = {3, 'e','n','t', '\0'};
-static const Py_UNICODE step2_eli[] = {3, 'e','l','i', '\0'};
-static const Py_UNICODE step2_e[] = {1, 'e', '\0'};
-static const Py_UNICODE step2_ousli[] = {5, 'o','u','s','l','i', '\0'};
-static const Py_UNICODE step2_ous[] = {3, 'o','u','s', '\0'};
-static const Py_UNICODE step2_ization[] = {7, 'i','z','a','t','i','o','n', '\0'};
-static const Py_UNICODE step2_ation[] = {5, 'a','t','i','o','n', '\0'};
-static const Py_UNICODE step2_ator[] = {4, 'a','t','o','r', '\0'};
-static const Py_UNICODE step2_alism[] = {5, 'a','l','i','s','m', '\0'};
-static const Py_UNICODE step2_iveness[] = {7, 'i','v','e','n','e','s','s', '\0'};
-static const Py_UNICODE step2_ive[] = {3, 'i','v','e', '\0'};
-static const Py_UNICODE step2_fulness[] = {7, 'f','u','l','n','e','s','s', '\0'};
-static const Py_UNICODE step2_ful[] = {3, 'f','u','l', '\0'};
-static const Py_UNICODE step2_ousness[] = {7, 'o','u','s','n','e','s','s', '\0'};
-static const Py_UNICODE step2_aliti[] = {5, 'a','l','i','t','i', '\0'};
-static const Py_UNICODE step2_iviti[] = {5, 'i','v','i','t','i', '\0'};
-static const Py_UNICODE step2_biliti[] = {6, 'b','i','l','i','t','i', '\0'};
-static const Py_UNICODE step2_logi[] = {4, 'l','o','g','i', '\0'};
-static const Py_UNICODE step2_log[] = {3, 'l','o','g', '\0'};
-
-static void step2(struct stemmer * z)
-{ 
-    switch (z->b[z->k-1])
-    {
-    case __U__'a': 
-        if (ends(z, step2_ational)) { r(z, step2_ate); break; }
-        if (ends(z, step2_tional)) { r(z, step2_tion); break; }
-        break;
-    case __U__'c': 
-        if (ends(z, step2_enci)) { r(z, step2_ence); break; }
-        if (ends(z, step2_anci)) { r(z, step2_ance); break; }
-        break;
-    case __U__'e':
-        if (ends(z, step2_izer)) { r(z, step2_ize); break; }
-        break;
-    case __U__'l':
-        if (ends(z, step2_bli)) { r(z, step2_ble); break; } /*-DEPARTURE-*/
+        else if (ch >= 0xc2 && ch < 0xe0) { extra = 1; min = 0x80; ch &= 0x1f; }
+        else if (ch >= 0xe0 && ch < 0xf0) { extra = 2; min = 0x800; ch &= 0x0f; }
+        else if (ch >= 0xf0 && ch < 0xf5) { extra = 3; min = 0x10000; ch &= 0x07; }
+        else return -1;
+        if (end - p < extra)
+            return -1;
+        for ( int i = 0; i < extra; ++i, ++p )
+        {
+            if ((*p & 0xc0) != 0x80)
+                return -1;
+            ch = (ch << 6) | (*p & 0x3f);
+        }
+        if (ch < min || ch > 0x10ffff || (ch >= 0xd800 && ch < 0xe000))
+            return -1;
+        p_out[n++] = ch;
+    }
+    return n;
+}
 
- /* To match the published algorithm, replace this line with
-    case __U__'l': if (ends(z, step2_abli)) { r(z, step2_able); break; } */
+static inline bool stopword_text_space(char ch)
+{
+    return ch == ' ' || ch == '\t' || ch == '\r';
+}
 
-        if (ends(z, step2_alli)) { r(z, step2_al); break; }
-        if (ends(z, step2_entli)) { r(z, step2_ent); break; }
-        if (ends(z, step2_eli)) { r(z, step2_e); break; }
-        if (ends(z, step2_ousli)) { r(z, step2_ous); break; }
-        break;
-    case __U__'o':
-        if (ends(z, step2_ization)) { r(z, step2_ize); break; }
-        if (ends(z, step2_ation)) { r(z, step2_ate); break; }
-        if (ends(z, step2_ator)) { r(z, step2_ate); break; }
-        break;
-    case __U__'s':
-        if (ends(z, step2_alism)) { r(z, step2_al); break; }
-        if (ends(z, step2_iveness)) { r(z, step2_ive); break; }
-        if (ends(z, step2_fulness)) { r(z, step2_ful); break; }
-        if (ends(z, step2_ousness)) { r(z, step2_ous); break; }
-        break;
-    case __U__'t':
-        if (ends(z, step2_aliti)) { r(z, step2_al); break; }
-        if (ends(z, step2_iviti)) { r(z, step2_ive); break; }
-        if (ends(z, step2_biliti)) { r(z, step2_ble); break; }
-        break;
-    case __U__'g':
-        if (ends(z, step2_logi)) { r(z, step2_log); break; } /*-DEPARTURE-*/
+/*  stopword_text(p_text, len, p_words, p_line) decodes a stopword file, one
+    word per line in UTF-8, into p_words, each word as its length followed
+    by its characters. Blank lines, a byte order mark and spaces, tabs and
+    carriage returns around a word are ignored. Returns the number of
+    words, or -1 with *p_line set to the first line that isn't valid UTF-8,
+    counting from 1. May throw bad_alloc. */
+
+static ptrdiff_t stopword_text(const char* p_text, size_t len, std::vector<Py_UCS4>* p_words, size_t* p_line)
+{
+    const char* p = p_text;
+    const char* end = p_text + len;
+    if (len >= 3 && memcmp(p, "\xef\xbb\xbf", 3) == 0)
+        p += 3;
+
+    ptrdiff_t num_words = 0;
+    size_t used = 0;
+    for ( size_t line = 1; p < end; ++line )
+    {
+        const char* p_eol = (const char*)memchr(p, '\n', end - p);
+        if (p_eol == NULL)
+            p_eol = end;
+        const char* p_start = p;
+        const char* p_end = p_eol;
+        p = p_eol + 1;
+        while (p_start < p_end && stopword_text_space(*p_start))
+            ++p_start;
+        while (p_end > p_start && stopword_text_space(p_end[-1]))
+            --p_end;
+        if (p_start == p_end)
+            continue;
+
+        if (p_words->size() < used + 1 + (p_end - p_start))
+            p_words->resize(2 * (used + 1 + (p_end - p_start)));
+        Py_UCS4* p_word = p_words->data() + used;
+        ptrdiff_t word_len = utf8_decode((const unsigned char*)p_start, (const unsigned char*)p_end, p_word + 1);
+        if (word_len < 0)
+        {
+            *p_line = line;
+            return -1;
+        }
+        p_word[0] = (Py_UCS4)word_len;
+        used += 1 + word_len;
+        ++num_words;
     }
+    p_words->resize(used);
+    return num_words;
 }
 
-/* step3(z) deals with -ic-, -full, -ness etc. similar strategy to step2. */
+/*  stopword_load(path, pp_table, p_error, p_line) reads the stopword file
+    or image at path into a new table, *pp_table. An image is mapped where
+    mmap is available and read in whole otherwise. Returns a
+    STOPWORD_LOAD_ code, setting *p_error to errno for STOPWORD_LOAD_OS_ERROR
+    and *p_line to the bad line for STOPWORD_LOAD_BAD_TEXT. No Python in
+    here, so it runs without the GIL. */
 
-static const Py_UNICODE step3_icate[] = {5, 'i','c','a','t','e', '\0'};
-static const Py_UNICODE step3_ic[] = {2, 'i','c', '\0'};
-static const Py_UNICODE step3_ative[] = {5, 'a','t','i','v','e', '\0'};
-static const Py_UNICODE step3_null[] = {0, '\0'};
-static const Py_UNICODE step3_alize[] = {5, 'a','l','i','z','e', '\0'};
-static const Py_UNICODE step3_al[] = {2, 'a','l', '\0'};
-static const Py_UNICODE step3_iciti[] = {5, 'i','c','i','t','i', '\0'};
-static const Py_UNICODE step3_ical[] = {4, 'i','c','a','l', '\0'};
-static const Py_UNICODE step3_ful[] = {3, 'f','u','l', '\0'};
-static const Py_UNICODE step3_ness[] = {4, 'n','e','s','s', '\0'};
+enum
+{
+    STOPWORD_LOAD_OK,
+    STOPWORD_LOAD_OS_ERROR,
+    STOPWORD_LOAD_NO_MEMORY,
+    STOPWORD_LOAD_BAD_TEXT,
+    STOPWORD_LOAD_BAD_IMAGE
+};
 
-static void step3(struct stemmer * z) 
-{ 
-    switch (z->b[z->k])
+static int stopword_load_text(FILE* p_file, StopwordTable** pp_table, int* p_error, size_t* p_line)
+{
+    std::vector<char> text;
+    size_t len = 0;
+    while (true)
     {
-    case L'e':
-        if (ends(z, step3_icate)) { r(z, step3_ic); break; }
-        if (ends(z, step3_ative)) { r(z, step3_null); break; }
-        if (ends(z, step3_alize)) { r(z, step3_al); break; }
-        break;
-    case L'i':
-        if (ends(z, step3_iciti)) { r(z, step3_ic); break; }
-        break;
-    case L'l':
-        if (ends(z, step3_ical)) { r(z, step3_ic); break; }
-        if (ends(z, step3_ful)) { r(z, step3_null); break; }
-        break;
-    case L's':
-        if (ends(z, step3_ness)) { r(z, step3_null); break; }
-        break;
+        if (text.size() < len + 65536)
+            text.resize(2 * (len + 65536));
+        size_t got = fread(text.data() + len, 1, text.size() - len, p_file);
+        len += got;
+        if (got == 0)
+            break;
+    }
+    if (ferror(p_file))
+    {
+        *p_error = errno;
+        return STOPWORD_LOAD_OS_ERROR;
     }
+
+    std::vector<Py_UCS4> words;
+    ptrdiff_t num_words = stopword_text(text.data(), len, &words, p_line);
+    if (num_words < 0)
+        return STOPWORD_LOAD_BAD_TEXT;
+    std::vector<char>().swap(text);
+
+    /* each word takes its length, its characters and a zero in the arena */
+    StopwordTable* p_table = stopword_new(STOPWORD_HEADROOM(num_words),
+                                          STOPWORD_HEADROOM(words.size() + num_words));
+    if (p_table == NULL)
+        return STOPWORD_LOAD_NO_MEMORY;
+    for ( size_t pos = 0; pos < words.size(); pos += 1 + words[pos] )
+        stopword_insert(p_table, &words[pos + 1], words[pos]);
+    *pp_table = p_table;
+    return STOPWORD_LOAD_OK;
 }
 
-/* step4(z) takes off -ant, -ence etc., in context <c>vcvc<v>. */
-
-static const Py_UNICODE step4_al[] = {2, 'a','l', '\0'};
-static const Py_UNICODE step4_ance[] = {4, 'a','n','c','e', '\0'};
-static const Py_UNICODE step4_ence[] = {4, 'e','n','c','e', '\0'};
-static const Py_UNICODE step4_er[] = {2, 'e','r', '\0'};
-static const Py_UNICODE step4_ic[] = {2, 'i','c', '\0'};
-static const Py_UNICODE step4_able[] = {4, 'a','b','l','e', '\0'};
-static const Py_UNICODE step4_ible[] = {4, 'i','b','l','e', '\0'};
-static const Py_UNICODE step4_ant[] = {3, 'a','n','t', '\0'};
-static const Py_UNICODE step4_ement[] = {5, 'e','m','e','n','t', '\0'};
-static const Py_UNICODE step4_ment[] = {4, 'm','e','n','t', '\0'};
-static const Py_UNICODE step4_ent[] = {3, 'e','n','t', '\0'};
-static const Py_UNICODE step4_ion[] = {3, 'i','o','n', '\0'};
-static const Py_UNICODE step4_ou[] = {2, 'o','u', '\0'};
-static const Py_UNICODE step4_ism[] = {3, 'i','s','m', '\0'};
-static const Py_UNICODE step4_ate[] = {3, 'a','t','e', '\0'};
-static const Py_UNICODE step4_iti[] = {3, 'i','t','i', '\0'};
-static const Py_UNICODE step4_ous[] = {3, 'o','u','s', '\0'};
-static const Py_UNICODE step4_ive[] = {3, 'i','v','e', '\0'};
-static const Py_UNICODE step4_ize[] = {3, 'i','z','e', '\0'};
-
-static void step4(struct stemmer * z)
-{
-    switch (z->b[z->k-1])
-    {
-        case __U__'a': 
-            if (ends(z, step4_al)) break; return;
-        case __U__'c': 
-            if (ends(z, step4_ance)) break;
-            if (ends(z, step4_ence)) break; return;
-        case __U__'e': 
-            if (ends(z, step4_er)) break; return;
-        case __U__'i': 
-            if (ends(z, step4_ic)) break; return;
-        case __U__'l': 
-            if (ends(z, step4_able)) break;
-            if (ends(z, step4_ible)) break; return;
-        case __U__'n': 
-            if (ends(z, step4_ant)) break;
-            if (ends(z, step4_ement)) break;
-            if (ends(z, step4_ment)) break;
-            if (ends(z, step4_ent)) break; return;
-        case __U__'o': 
-            if (ends(z, step4_ion) && (z->b[z->j] == 's' || z->b[z->j] == 't')) break;
-            if (ends(z, step4_ou)) break; return;
-            /* takes care of -ous */
-        case __U__'s': 
-            if (ends(z, step4_ism)) break; return;
-        case __U__'t': 
-            if (ends(z, step4_ate)) break;
-            if (ends(z, step4_iti)) break; return;
-        case __U__'u': 
-            if (ends(z, step4_ous)) break; return;
-        case __U__'v': 
-            if (ends(z, step4_ive)) break; return;
-        case __U__'z': 
-            if (ends(z, step4_ize)) break; return;
-        default: 
-            return;
-    }
-    if (m(z) > 1) z->k = z->j;
-}
-
-/* step5(z) removes a final -e if m(z) > 1, and changes -ll to -l if
-    m(z) > 1. */
-
-static void step5(struct stemmer * z)
-{
-    Py_UNICODE * b = z->b;
-    z->j = z->k;
-    if (b[z->k] == __U__'e')
-    {
-        int a = m(z);
-        if (((a > 1) || (a == 1)) && !cvc(z, z->k - 1)) z->k--;
-    }
-    if (b[z->k] == __U__'l' && doublec(z, z->k) && m(z) > 1) z->k--;
-}
-
-/* In stem(z, b, k), b is a Py_UNICODE pointer, and the string to be stemmed is
-    from b[0] to b[k] inclusive.  Possibly b[k+1] == '\0', but it is not
-    important. The stemmer adjusts the characters b[0] ... b[k] and returns
-    the new end-point of the string, k'. Stemming never increases word
-    length, so 0 <= k' <= k.
-*/
-// $KB: updated to take and return string length instead of a zero-based offset
-extern int stem(struct stemmer * z, Py_UNICODE * b, int b_len, int plurals_only)
+static int stopword_load_image(FILE* p_file, StopwordTable** pp_table, int* p_error)
+{
+    StopwordTable* p_table = new (std::nothrow) StopwordTable;
+    if (p_table == NULL)
+        return STOPWORD_LOAD_NO_MEMORY;
+
+#ifdef STOPWORD_MMAP
+    struct stat st;
+    int fd = fileno(p_file);
+    void* p_map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        p_map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (p_map == MAP_FAILED)
+    {
+        *p_error = errno;
+        delete p_table;
+        return STOPWORD_LOAD_OS_ERROR;
+    }
+    p_table->p_map = p_map;
+    p_table->map_len = (size_t)st.st_size;
+    char* p_image = (char*)p_map;
+    size_t len = (size_t)st.st_size;
+#else
+    size_t len = 0;
+    try
+    {
+        while (true)
+        {
+            if (p_table->image_store.size() * sizeof(uint64_t) < len + 65536)
+                p_table->image_store.resize(2 * (len + 65536) / sizeof(uint64_t));
+            size_t got = fread((char*)p_table->image_store.data() + len, 1,
+                               p_table->image_store.size() * sizeof(uint64_t) - len, p_file);
+            len += got;
+            if (got == 0)
+                break;
+        }
+    }
+    catch (const std::bad_alloc&)
+    {
+        delete p_table;
+        return STOPWORD_LOAD_NO_MEMORY;
+    }
+    if (ferror(p_file))
+    {
+        *p_error = errno;
+        delete p_table;
+        return STOPWORD_LOAD_OS_ERROR;
+    }
+    char* p_image = (char*)p_table->image_store.data();
+#endif
+    if (!stopword_from_image(p_table, p_image, len))
+    {
+        delete p_table;
+        return STOPWORD_LOAD_BAD_IMAGE;
+    }
+    *pp_table = p_table;
+    return STOPWORD_LOAD_OK;
+}
+
+static int stopword_load(const char* path, StopwordTable** pp_table, int* p_error, size_t* p_line)
 {
-    if (b_len <= 2) return b_len; /*-DEPARTURE-*/
-    z->b = b; z->k = (b_len-1); /* copy the parameters into z */
+    FILE* p_file = fopen(path, "rb");
+    if (p_file == NULL)
+    {
+        *p_error = errno;
+        return STOPWORD_LOAD_OS_ERROR;
+    }
 
-    /* With this line, strings of length 1 or 2 don't go through the
-      stemming process, although no mention is made of this in the
-      published algorithm. Remove the line to match the published
-      algorithm. */
+    char magic[sizeof(STOPWORD_IMAGE_MAGIC)];
+    bool is_image = fread(magic, 1, sizeof(magic), p_file) == sizeof(magic) &&
+                    memcmp(magic, STOPWORD_IMAGE_MAGIC, sizeof(magic)) == 0;
+    rewind(p_file);
 
-    step1a(z);
-    if (plurals_only)
+    int status;
+    try
     {
-        step5(z); // remove the trailing e
+        status = is_image ? stopword_load_image(p_file, pp_table, p_error)
+                          : stopword_load_text(p_file, pp_table, p_error, p_line);
     }
-    else
+    catch (const std::bad_alloc&)
     {
-        step1b(z); step1c(z); step2(z); step3(z); step4(z); step5(z);
+        status = STOPWORD_LOAD_NO_MEMORY;
     }
-    return z->k + 1;
+    fclose(p_file);
+    return status;
+}
+
+/*  $KB: scratch buffers for long words. Each thread keeps one per code unit
+    type, and reuses it for the next long word, so a word only allocates
+    when it is longer than any seen on that thread before. A buffer that has
+    grown past STEM_SCRATCH_KEEP units is given back after use rather than
+    pinning the memory of one huge token for good. */
+
+template <typename T>
+static std::vector<T>& scratch_buffer()
+{
+    static thread_local std::vector<T> t_buffer;
+    return t_buffer;
+}
+
+/* scratch_get<T>(len) is a buffer for len items; may throw bad_alloc */
+
+template <typename T>
+static T* scratch_get(size_t len)
+{
+    std::vector<T>& buffer = scratch_buffer<T>();
+    if (buffer.size() < len)
+        buffer.resize(len);
+    return buffer.data();
+}
+
+template <typename T>
+static void scratch_trim()
+{
+    std::vector<T>& buffer = scratch_buffer<T>();
+    if (buffer.size() > STEM_SCRATCH_KEEP)
+        std::vector<T>().swap(buffer);
 }
 
 /* -PY- */
 void dump_stopwords()
 {
     printf("[");
-    StopwordSet::iterator it = g_stopwords.begin();
-    StopwordSet::iterator it_end = g_stopwords.end();
-    for(int first_time=1; it != it_end; ++it)
+    int first_time = 1;
+    StopwordTable* p_table = stopwords_gil();
+    for ( size_t idx = 0; idx < p_table->num_slots; ++idx )
     {
+        unsigned int offset = slot_offset(p_table->slots[idx].load());
+        if (offset >= STOPWORD_TOMBSTONE)
+            continue;
+
         if (first_time)
             first_time=0;
         else
             printf(", ");
-        
+
         printf("'");
-        pyunicode_print(*it);
+        pyunicode_print(&p_table->arena[offset + 1]);
         printf("'");
     }
     printf("]");
 }
 
-static PyObject* py_stem(PyObject* self, PyObject* args)
-{
-    const Py_UNICODE* str;
-    int plurals_only = 0;
+/*  $KB: a word of up to STEM_SMALL_WORD code units is stemmed in a buffer on
+    the stack; anything longer, like a url or a base64 blob, goes to the
+    thread's scratch buffer. word_buffer(p_small, len) picks one, and also
+    reserves the kernel's own scratch space for a long word up front, so
+    stemming it can't run out of memory. It sets a Python error and returns
+    NULL if there is no room, or if the word is too long for the kernel's
+    int. */
 
-    if (!PyArg_ParseTuple(args, "u|i", &str, &plurals_only))
-        return NULL;
+#define STEM_SMALL_WORD 128
 
-    int str_len = pyunicode_slen(str);
-    if ( str_len >= 255 )
+template <typename CharT>
+static CharT* word_buffer(CharT* p_small, Py_ssize_t len)
+{
+    if (len <= STEM_SMALL_WORD)
+        return p_small;
+    if (len > INT_MAX)
+    {
+        PyErr_SetString(PyExc_OverflowError, "word is too long to stem");
+        return NULL;
+    }
+    try
+    {
+        porter::reserve(len);
+        return scratch_get<CharT>(len);
+    }
+    catch (const std::bad_alloc&)
     {
-        PyErr_SetString(PyExc_IndexError, "stemmer only works with strings < 255 chars");
-        return 0;
+        PyErr_NoMemory();
+        return NULL;
     }
+}
+
+/*  stem_into(str, str_len, newstr, plurals_only) writes the stem of str[0]
+    ... str[str_len-1] to newstr and returns its length, or returns -1 without
+    touching newstr if the word is left as it is. That covers the stopwords
+    and every word none of the steps apply to, which is most short words. */
+
+template <typename CharT>
+static int stem_into(const CharT* str, int str_len, CharT* newstr, int plurals_only)
+{
+    if (is_stopword(stopwords_gil(), str, str_len))
+        return -1;
+
+    memcpy(newstr, str, str_len * sizeof(CharT));
+    int stem_len = (int)porter::stem_in_place(newstr, str_len, plurals_only);
+
+    /*  stemming never lengthens a word, so an unchanged one keeps its length;
+        the reverse doesn't hold (step1c turns happy into happi) */
+    if (stem_len == str_len && memcmp(newstr, str, str_len * sizeof(CharT)) == 0)
+        return -1;
+    return stem_len;
+}
+
+/*  unicode_from_stem(p_str_obj, p_stem, len) returns a new str holding the
+    stem p_stem[0] ... p_stem[len-1] of p_str_obj, written straight into the
+    new object's storage.
+
+    A str must be stored at the narrowest kind its characters allow, and the
+    stem always needs the same kind as its word: the stemmer only ever takes
+    ascii letters off the end, or one of a doubled letter, so the word's
+    widest character is still there. The word's maximum character therefore
+    sizes the result without a scan. */
+
+template <typename CharT>
+static PyObject* unicode_from_stem(PyObject* p_str_obj, const CharT* p_stem, Py_ssize_t len)
+{
+    PyObject* token = PyUnicode_New(len, PyUnicode_MAX_CHAR_VALUE(p_str_obj));
+    if (token == NULL)
+        return NULL;
+
+    int kind = PyUnicode_KIND(token);
+    void* p_data = PyUnicode_DATA(token);
+    if (kind == sizeof(CharT))
+        memcpy(p_data, p_stem, len * sizeof(CharT));
+    else
+        for ( Py_ssize_t i = 0; i < len; ++i )
+            PyUnicode_WRITE(kind, p_data, i, p_stem[i]);
+    return token;
+}
+
+/*  stem_unicode_kind(p_str_obj, str, plurals_only) stems a str whose
+    characters are stored as CharT, reading them in place. When the word
+    comes back unchanged it returns p_str_obj itself with a new reference, so
+    the common case neither allocates nor copies anything out. A subclass
+    still gets a plain str back. */
+
+template <typename CharT>
+static PyObject* stem_unicode_kind(PyObject* p_str_obj, const CharT* str, int plurals_only)
+{
+    Py_ssize_t str_len = PyUnicode_GET_LENGTH(p_str_obj);
 
 /*
     printf("stopwords:");
@@ -638,91 +872,2155 @@ static PyObject* py_stem(PyObject* self, PyObject* args)
     printf("\n");
 */
 
-    PyObject* token = NULL;
-    if (g_stopwords.find(str) == g_stopwords.end())
+    /* scratch space only, the stem is copied out by its length */
+    CharT small[STEM_SMALL_WORD];
+    CharT* newstr = word_buffer(small, str_len);
+    if (newstr == NULL)
+        return NULL;
+
+    PyObject* token;
+    int stem_len = stem_into(str, (int)str_len, newstr, plurals_only);
+    if (stem_len >= 0)
+        token = unicode_from_stem(p_str_obj, newstr, stem_len);
+    else if (!PyUnicode_CheckExact(p_str_obj))
+        token = unicode_from_stem(p_str_obj, str, str_len);
+    else
     {
-        stemmer z;
-    
-        Py_UNICODE newstr[255] = {0};
-        memcpy(newstr, str, str_len * sizeof(Py_UNICODE));
-        int stem_len = stem(&z, newstr, str_len, plurals_only);
-        newstr[stem_len + 1] = 0;
-    
-        token = PyUnicode_FromUnicode(newstr, stem_len);        
+        Py_INCREF(p_str_obj);
+        token = p_str_obj;
     }
-    else
+    if (newstr != small)
+        scratch_trim<CharT>();
+    return token;
+}
+
+/*  $KB: a str is stemmed in whichever of its PEP 393 forms it is stored:
+    one, two or four bytes per character. Nothing is converted on the way in
+    and the result is built directly at the right width on the way out.
+    Shared by the single word and the batch entry points. */
+
+static PyObject* stem_unicode(PyObject* p_str_obj, int plurals_only)
+{
+    if (STEMMER_UNICODE_READY(p_str_obj) < 0)
+        return NULL;
+
+    switch (PyUnicode_KIND(p_str_obj))
     {
-        token = PyUnicode_FromUnicode(str, str_len);
+    case PyUnicode_1BYTE_KIND:
+        return stem_unicode_kind(p_str_obj, PyUnicode_1BYTE_DATA(p_str_obj), plurals_only);
+    case PyUnicode_2BYTE_KIND:
+        return stem_unicode_kind(p_str_obj, PyUnicode_2BYTE_DATA(p_str_obj), plurals_only);
+    default:
+        return stem_unicode_kind(p_str_obj, PyUnicode_4BYTE_DATA(p_str_obj), plurals_only);
     }
+}
+
+/*  stem_bytes is stem_unicode for a bytes object, which is stemmed directly on
+    its bytes. Meant for ascii words; any other byte is simply a consonant. */
 
+static PyObject* stem_bytes(PyObject* p_str_obj, int plurals_only)
+{
+    const char* str = PyBytes_AS_STRING(p_str_obj);
+    Py_ssize_t str_len = PyBytes_GET_SIZE(p_str_obj);
+
+    unsigned char small[STEM_SMALL_WORD];
+    unsigned char* newstr = word_buffer(small, str_len);
+    if (newstr == NULL)
+        return NULL;
+
+    PyObject* token;
+    int stem_len = stem_into((const unsigned char*)str, (int)str_len, newstr, plurals_only);
+    if (stem_len >= 0)
+        token = PyBytes_FromStringAndSize((const char*)newstr, stem_len);
+    else if (!PyBytes_CheckExact(p_str_obj))
+        token = PyBytes_FromStringAndSize(str, str_len);
+    else
+    {
+        Py_INCREF(p_str_obj);
+        token = p_str_obj;
+    }
+    if (newstr != small)
+        scratch_trim<unsigned char>();
     return token;
 }
 
-static void clean_up(StopwordSet stopwords)
+/* is_word(p) is TRUE <=> p is something stem() accepts */
+
+static inline int is_word(PyObject* p_obj)
+{
+    return PyUnicode_Check(p_obj) || PyBytes_Check(p_obj);
+}
+
+/* stem_word(p_str_obj, plurals_only) stems a str or bytes object */
+
+static PyObject* stem_word(PyObject* p_str_obj, int plurals_only)
+{
+    if (PyUnicode_Check(p_str_obj))
+        return stem_unicode(p_str_obj, plurals_only);
+    return stem_bytes(p_str_obj, plurals_only);
+}
+
+/*  $KB: optional stem cache. Natural language is heavily Zipfian, so most
+    calls stem a word that has been seen recently. The cache is a direct
+    mapped table of g_cache_size slots (a power of two, 0 when disabled)
+    indexed by the word's hash and the plurals_only flag. Each slot owns a
+    reference to the word and to the stem object handed out for it, and a
+    colliding word simply evicts the previous occupant. A str subclass with
+    a __hash__ of its own is never cached, so a word's slot only depends on
+    its characters; see cache_forget(). */
+
+struct cache_entry
+{
+    PyObject* word;
+    PyObject* token;
+    int plurals_only;
+};
+
+static cache_entry* g_cache = NULL;
+static Py_ssize_t g_cache_size = 0;
+static Py_ssize_t g_cache_used = 0;
+static Py_ssize_t g_cache_hits = 0;
+static Py_ssize_t g_cache_misses = 0;
+static Py_ssize_t g_cache_evictions = 0;
+
+static int same_word(PyObject* p_a, PyObject* p_b)
+{
+    if (p_a == p_b)
+        return TRUE;
+    if (Py_TYPE(p_a) != Py_TYPE(p_b))
+        return FALSE; /* a str subclass may stem differently */
+    if (PyUnicode_Check(p_a))
+    {
+        /* equal strs are stored at the same kind */
+        Py_ssize_t len = PyUnicode_GET_LENGTH(p_a);
+        int kind = PyUnicode_KIND(p_a);
+        return len == PyUnicode_GET_LENGTH(p_b) && kind == (int)PyUnicode_KIND(p_b) &&
+            memcmp(PyUnicode_DATA(p_a), PyUnicode_DATA(p_b), len * kind) == 0;
+    }
+    Py_ssize_t len = PyBytes_GET_SIZE(p_a);
+    return len == PyBytes_GET_SIZE(p_b) &&
+        memcmp(PyBytes_AS_STRING(p_a), PyBytes_AS_STRING(p_b), len) == 0;
+}
+
+static void cache_clear()
 {
-    StopwordSet::iterator it = stopwords.begin();
-    StopwordSet::iterator it_end = stopwords.end();
-    while((it = stopwords.begin()) != stopwords.end())
+    for ( Py_ssize_t idx = 0; idx < g_cache_size; ++idx )
     {
-        const Py_UNICODE* tmp = *it;
-        stopwords.erase(it);
-        delete [] tmp;
+        Py_CLEAR(g_cache[idx].word);
+        Py_CLEAR(g_cache[idx].token);
     }
+    g_cache_used = 0;
 }
 
-static PyObject* py_set_stopwords(PyObject* self, PyObject* args)
+static inline cache_entry* cache_slot(Py_hash_t hash, int plurals_only)
 {
-    PyObject * p_list_obj; /* the list of strings */
+    return g_cache + (((size_t)hash ^ (plurals_only ? 0x9e3779b9 : 0)) & (g_cache_size - 1));
+}
 
-    if (! PyArg_ParseTuple( args, "O!", &PyList_Type, &p_list_obj ))
-        return NULL;
-    
-    int num_lines = PyList_Size(p_list_obj);
-    if (num_lines < 0)
-        return NULL; /* Not a list */
+/*  cache_forget(p_str_obj) drops whatever is cached in the slots of the str
+    p_str_obj. A bytes object hashes like the str of the same code units, so
+    that covers both spellings of a stopword that changed. */
+
+static void cache_forget(PyObject* p_str_obj)
+{
+    if (g_cache_size == 0)
+        return;
 
-    StopwordSet stopwords;
-    PyObject* p_str_obj;
-    Py_UNICODE* p_stopword;
-    int err = 0;
-    for ( int idx = 0; idx < num_lines; ++idx )
+    Py_hash_t hash = PyUnicode_Type.tp_hash(p_str_obj);
+    for ( int plurals_only = 0; plurals_only < 2; ++plurals_only )
     {
-        p_str_obj = PyList_GetItem(p_list_obj, idx);
-        if (PyUnicode_Check(p_str_obj) == 0)
-        {
-            err = 1;
-            break;
-        }
-        Py_ssize_t len = PyUnicode_GetSize(p_str_obj);
-        p_stopword = new Py_UNICODE[len+1];
-        memcpy(p_stopword, ((PyUnicodeObject*)p_str_obj)->str, len * sizeof(Py_UNICODE));
-        p_stopword[len] = 0;        
-        stopwords.insert(p_stopword);
+        /* empty the slot before releasing its objects, that could run
+           arbitrary code */
+        cache_entry* p_entry = cache_slot(hash, plurals_only);
+        PyObject* p_old_word = p_entry->word;
+        PyObject* p_old_token = p_entry->token;
+        if (p_old_word == NULL)
+            continue;
+        p_entry->word = NULL;
+        p_entry->token = NULL;
+        --g_cache_used;
+        Py_DECREF(p_old_word);
+        Py_DECREF(p_old_token);
     }
-    
-    if (err)
+}
+
+/*  stem_object(p_str_obj, plurals_only) is stem_word, going through the
+    cache when it is enabled. */
+
+static PyObject* stem_object(PyObject* p_str_obj, int plurals_only)
+{
+    hashfunc tp_hash = Py_TYPE(p_str_obj)->tp_hash;
+    if (g_cache_size == 0 || (tp_hash != PyUnicode_Type.tp_hash && tp_hash != PyBytes_Type.tp_hash))
+        return stem_word(p_str_obj, plurals_only);
+
+    Py_hash_t hash = PyObject_Hash(p_str_obj);
+    if (hash == -1)
+        return NULL;
+
+    cache_entry* p_entry = cache_slot(hash, plurals_only);
+    if (p_entry->word != NULL && p_entry->plurals_only == plurals_only &&
+        same_word(p_entry->word, p_str_obj))
     {
-        clean_up(stopwords);
+        ++g_cache_hits;
+        Py_INCREF(p_entry->token);
+        return p_entry->token;
+    }
+
+    ++g_cache_misses;
+    PyObject* token = stem_word(p_str_obj, plurals_only);
+    if (token == NULL)
         return NULL;
+
+    /* fill the slot before releasing the old occupant, the deallocation could
+       run arbitrary code */
+    PyObject* p_old_word = p_entry->word;
+    PyObject* p_old_token = p_entry->token;
+    Py_INCREF(p_str_obj);
+    Py_INCREF(token);
+    p_entry->word = p_str_obj;
+    p_entry->token = token;
+    p_entry->plurals_only = plurals_only;
+    if (p_old_word != NULL)
+    {
+        ++g_cache_evictions;
+        Py_DECREF(p_old_word);
+        Py_DECREF(p_old_token);
     }
-    
-    StopwordSet old_stopwords = g_stopwords;
-    g_stopwords = stopwords;
-    clean_up(old_stopwords);
-    
-    Py_INCREF(Py_None);
-    return Py_None;
+    else
+    {
+        ++g_cache_used;
+    }
+
+    return token;
 }
 
-static PyMethodDef StemMethods[] =
+/*  $KB: stem() is called once per word, so it is a METH_FASTCALL function
+    that is handed a plain array of arguments and unpacks them by hand;
+    format string parsing with PyArg_ParseTuple costs more than stemming a
+    short word. */
+
+static PyObject* py_stem(PyObject* self, PyObject* const* pp_args, Py_ssize_t num_args)
 {
-     {"stem", py_stem, METH_VARARGS, "run a unicode string through the Porter Stemmer."},
-     {"set_stopwords", py_set_stopwords, METH_VARARGS, "assign a sequence of words for which stemming will be ignored."},
-     {NULL, NULL, 0, NULL}
+    if ( num_args < 1 || num_args > 2 )
+    {
+        PyErr_Format(PyExc_TypeError, "stem() takes 1 or 2 arguments (%zd given)", num_args);
+        return NULL;
+    }
+
+    PyObject* p_str_obj = pp_args[0];
+    if (!is_word(p_str_obj))
+    {
+        PyErr_SetString(PyExc_TypeError, "stem expects a str or bytes argument");
+        return NULL;
+    }
+
+    int plurals_only = 0;
+    if ( num_args == 2 )
+    {
+        /* like the old "i" format: any integer, but not a float */
+        if (PyFloat_Check(pp_args[1]))
+        {
+            PyErr_SetString(PyExc_TypeError, "integer argument expected, got float");
+            return NULL;
+        }
+        long value = PyLong_AsLong(pp_args[1]);
+        if (value == -1 && PyErr_Occurred())
+            return NULL;
+        plurals_only = (value != 0);
+    }
+
+    return stem_object(p_str_obj, plurals_only);
+}
+
+static PyObject* py_set_cache_size(PyObject* self, PyObject* args)
+{
+    Py_ssize_t size;
+
+    if (!PyArg_ParseTuple(args, "n", &size))
+        return NULL;
+
+    if (size < 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "cache size must be >= 0");
+        return NULL;
+    }
+
+    /* round up to a power of two so a slot is just a mask of the hash */
+    Py_ssize_t slots = 0;
+    if (size > 0)
+        for (slots = 1; slots < size; slots <<= 1);
+
+    cache_entry* p_cache = NULL;
+    if (slots > 0)
+    {
+        p_cache = PyMem_New(cache_entry, slots);
+        if (p_cache == NULL)
+            return PyErr_NoMemory();
+        memset(p_cache, 0, slots * sizeof(cache_entry));
+    }
+
+    cache_clear();
+    PyMem_Free(g_cache);
+    g_cache = p_cache;
+    g_cache_size = slots;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* py_cache_info(PyObject* self, PyObject* args)
+{
+    return Py_BuildValue("{s:n,s:n,s:n,s:n,s:n}",
+                         "hits", g_cache_hits,
+                         "misses", g_cache_misses,
+                         "evictions", g_cache_evictions,
+                         "maxsize", g_cache_size,
+                         "currsize", g_cache_used);
+}
+
+static PyObject* py_cache_clear(PyObject* self, PyObject* args)
+{
+    cache_clear();
+    g_cache_hits = g_cache_misses = g_cache_evictions = 0;
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/*  $KB: a batch of words for stem_many's threaded mode. The words are copied
+    back to back into buf, word idx starting at buf[offsets[idx]] and running
+    for lens[idx] characters. Stemming happens in place and lens[idx] is
+    updated to the stemmed length. A negative length marks a stopword, which
+    is left alone. Narrower strs and bytes are widened on the way in and
+    narrowed again on the way out.
+
+    Nothing in here touches a Python object, so the workers can run without
+    holding the GIL; the kernel keeps all per-word state on the worker's
+    stack. A long word can still fail to get scratch space, and an exception
+    must not escape a thread, so a worker that runs out of memory sets
+    no_memory and stops; stem_many raises MemoryError after the join. */
+
+struct stem_batch
+{
+    std::vector<Py_UCS4> buf;
+    std::vector<Py_ssize_t> offsets;
+    std::vector<int> lens;
+    std::vector<char> is_bytes;
+    int plurals_only;
+    std::atomic<bool> no_memory;
+
+    stem_batch() : plurals_only(0), no_memory(false) {}
+};
+
+static void stem_batch_range(stem_batch* p_batch, Py_ssize_t first, Py_ssize_t last)
+{
+    try
+    {
+        for ( Py_ssize_t idx = first; idx < last; ++idx )
+        {
+            int len = p_batch->lens[idx];
+            if (len < 0)
+                continue;
+            p_batch->lens[idx] = (int)porter::stem_in_place(p_batch->buf.data() + p_batch->offsets[idx],
+                                                            len, p_batch->plurals_only);
+        }
+    }
+    catch (const std::bad_alloc&)
+    {
+        p_batch->no_memory.store(true);
+    }
+}
+
+/*  batch_add(p_dst, str, len) copies a word into the batch, or returns -1 for
+    a stopword, which is left out */
+
+template <typename CharT>
+static int batch_add(Py_UCS4* p_dst, const CharT* str, int len)
+{
+    if (is_stopword(stopwords_gil(), str, len))
+        return -1;
+    for ( int i = 0; i < len; ++i )
+        p_dst[i] = str[i];
+    return len;
+}
+
+/*  same_stem(p_batch, idx, p_str_obj) is TRUE <=> the stem of word idx is
+    p_str_obj unchanged, so the result list can share it as stem() does */
+
+static bool same_stem(const stem_batch* p_batch, Py_ssize_t idx, PyObject* p_str_obj)
+{
+    const Py_UCS4* p_stem = p_batch->buf.data() + p_batch->offsets[idx];
+    int len = p_batch->lens[idx];
+    if (p_batch->is_bytes[idx])
+        return PyBytes_CheckExact(p_str_obj) && PyBytes_GET_SIZE(p_str_obj) == len &&
+               same_chars(p_stem, (const unsigned char*)PyBytes_AS_STRING(p_str_obj), len);
+    if (!PyUnicode_CheckExact(p_str_obj) || PyUnicode_GET_LENGTH(p_str_obj) != len)
+        return false;
+    switch (PyUnicode_KIND(p_str_obj))
+    {
+    case PyUnicode_1BYTE_KIND:
+        return same_chars(p_stem, PyUnicode_1BYTE_DATA(p_str_obj), len);
+    case PyUnicode_2BYTE_KIND:
+        return same_chars(p_stem, PyUnicode_2BYTE_DATA(p_str_obj), len);
+    default:
+        return same_chars(p_stem, PyUnicode_4BYTE_DATA(p_str_obj), len);
+    }
+}
+
+/* below this many words per thread, starting a thread costs more than it saves */
+#define MIN_WORDS_PER_THREAD 256
+
+/*  stem_many_threaded(p_words, ...) stems the tuple p_words. It has to be a
+    tuple we own: the GIL is released while the workers run, and another
+    thread could change a list under us meanwhile. */
+
+static PyObject* stem_many_threaded(PyObject* p_words, int plurals_only, int num_threads)
+{
+    Py_ssize_t num_words = PyTuple_GET_SIZE(p_words);
+    stem_batch batch;
+    batch.plurals_only = plurals_only;
+    batch.offsets.resize(num_words);
+    batch.lens.resize(num_words);
+    batch.is_bytes.resize(num_words);
+
+    /* copy the words out while we still hold the GIL */
+    Py_ssize_t total_len = 0;
+    for ( Py_ssize_t idx = 0; idx < num_words; ++idx )
+    {
+        PyObject* p_str_obj = PyTuple_GET_ITEM(p_words, idx);
+        if (!is_word(p_str_obj))
+        {
+            PyErr_SetString(PyExc_TypeError, "stem_many expects a sequence of str or bytes");
+            return NULL;
+        }
+        batch.is_bytes[idx] = !PyUnicode_Check(p_str_obj);
+        if (!batch.is_bytes[idx] && STEMMER_UNICODE_READY(p_str_obj) < 0)
+            return NULL;
+        Py_ssize_t len = batch.is_bytes[idx] ? PyBytes_GET_SIZE(p_str_obj) : PyUnicode_GET_LENGTH(p_str_obj);
+        if ( len > INT_MAX )
+        {
+            PyErr_SetString(PyExc_OverflowError, "word is too long to stem");
+            return NULL;
+        }
+        batch.offsets[idx] = total_len;
+        batch.lens[idx] = (int)len;
+        total_len += len;
+    }
+
+    batch.buf.resize(total_len);
+    for ( Py_ssize_t idx = 0; idx < num_words; ++idx )
+    {
+        PyObject* p_str_obj = PyTuple_GET_ITEM(p_words, idx);
+        Py_UCS4* p_dst = batch.buf.data() + batch.offsets[idx];
+        int len = batch.lens[idx];
+        if (batch.is_bytes[idx])
+            batch.lens[idx] = batch_add(p_dst, (const unsigned char*)PyBytes_AS_STRING(p_str_obj), len);
+        else if (PyUnicode_KIND(p_str_obj) == PyUnicode_1BYTE_KIND)
+            batch.lens[idx] = batch_add(p_dst, PyUnicode_1BYTE_DATA(p_str_obj), len);
+        else if (PyUnicode_KIND(p_str_obj) == PyUnicode_2BYTE_KIND)
+            batch.lens[idx] = batch_add(p_dst, PyUnicode_2BYTE_DATA(p_str_obj), len);
+        else
+            batch.lens[idx] = batch_add(p_dst, PyUnicode_4BYTE_DATA(p_str_obj), len);
+    }
+
+    if (num_threads > num_words / MIN_WORDS_PER_THREAD)
+        num_threads = (int)(num_words / MIN_WORDS_PER_THREAD);
+    if (num_threads < 1)
+        num_threads = 1;
+
+    Py_BEGIN_ALLOW_THREADS
+    std::vector<std::thread> workers;
+    Py_ssize_t chunk = (num_words + num_threads - 1) / num_threads;
+    Py_ssize_t first = 0;
+    try
+    {
+        for ( int t = 1; t < num_threads; ++t, first += chunk )
+            workers.push_back(std::thread(stem_batch_range, &batch, first, first + chunk));
+    }
+    catch (...)
+    {
+        /* couldn't start another thread; this one picks up the rest */
+    }
+    stem_batch_range(&batch, first, num_words);
+    for ( size_t t = 0; t < workers.size(); ++t )
+        workers[t].join();
+    Py_END_ALLOW_THREADS
+
+    if (batch.no_memory.load())
+        return PyErr_NoMemory();
+
+    PyObject* p_result = PyList_New(num_words);
+    if (p_result == NULL)
+        return NULL;
+
+    for ( Py_ssize_t idx = 0; idx < num_words; ++idx )
+    {
+        PyObject* p_str_obj = PyTuple_GET_ITEM(p_words, idx);
+        PyObject* token;
+        if (batch.lens[idx] < 0 || same_stem(&batch, idx, p_str_obj))
+        {
+            token = p_str_obj;
+            Py_INCREF(token);
+        }
+        else
+        {
+            const Py_UCS4* p_stem = batch.buf.data() + batch.offsets[idx];
+            int len = batch.lens[idx];
+            if (batch.is_bytes[idx])
+            {
+                token = PyBytes_FromStringAndSize(NULL, len);
+                if (token != NULL)
+                    for ( int i = 0; i < len; ++i )
+                        PyBytes_AS_STRING(token)[i] = (char)p_stem[i];
+            }
+            else
+            {
+                token = unicode_from_stem(p_str_obj, p_stem, len);
+            }
+            if (token == NULL)
+            {
+                Py_DECREF(p_result);
+                return NULL;
+            }
+        }
+        PyList_SET_ITEM(p_result, idx, token);
+    }
+
+    return p_result;
+}
+
+/*  $KB: stem_many(words) stems a whole sequence in one call, so the argument
+    parsing and method dispatch are paid once per batch instead of once per
+    word. The length comes straight from the str object, so no
+    scan for a terminator is needed either.
+
+    With threads != 1 the batch is copied out, the GIL is released and the
+    words are split over that many native threads (0 means one per core). */
+
+static PyObject* py_stem_many(PyObject* self, PyObject* args, PyObject* kwds)
+{
+    static const char* kwlist[] = {"words", "plurals_only", "threads", NULL};
+    PyObject* p_words_obj;
+    int plurals_only = 0;
+    int num_threads = 1;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|ii:stem_many", (char**)kwlist,
+                                     &p_words_obj, &plurals_only, &num_threads))
+        return NULL;
+
+    if (num_threads < 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "threads must be >= 0");
+        return NULL;
+    }
+    if (num_threads == 0)
+        num_threads = (int)std::thread::hardware_concurrency();
+
+    PyObject* p_seq = PySequence_Fast(p_words_obj, "stem_many expects a sequence of str or bytes");
+    if (p_seq == NULL)
+        return NULL;
+
+    /* an owned snapshot: a list could change under us, while the GIL is
+       released or from a __del__ run by a cache eviction */
+    PyObject* p_words = PySequence_Tuple(p_seq);
+    Py_DECREF(p_seq);
+    if (p_words == NULL)
+        return NULL;
+
+    if (num_threads > 1)
+    {
+        PyObject* p_result = stem_many_threaded(p_words, plurals_only, num_threads);
+        Py_DECREF(p_words);
+        return p_result;
+    }
+
+    Py_ssize_t num_words = PyTuple_GET_SIZE(p_words);
+    PyObject* p_result = PyList_New(num_words);
+    if (p_result == NULL)
+    {
+        Py_DECREF(p_words);
+        return NULL;
+    }
+
+    for ( Py_ssize_t idx = 0; idx < num_words; ++idx )
+    {
+        PyObject* p_str_obj = PyTuple_GET_ITEM(p_words, idx);
+        if (!is_word(p_str_obj))
+        {
+            PyErr_SetString(PyExc_TypeError, "stem_many expects a sequence of str or bytes");
+            Py_DECREF(p_result);
+            Py_DECREF(p_words);
+            return NULL;
+        }
+
+        PyObject* token = stem_object(p_str_obj, plurals_only);
+        if (token == NULL)
+        {
+            Py_DECREF(p_result);
+            Py_DECREF(p_words);
+            return NULL;
+        }
+        PyList_SET_ITEM(p_result, idx, token);
+    }
+
+    Py_DECREF(p_words);
+    return p_result;
+}
+
+/*  $KB: stem_array is the result type of the batch calls that skip making a
+    Python object per word. It is a plain, read only array of fixed size
+    items that supports len() and indexing and exposes the buffer protocol,
+    so memoryview or numpy.frombuffer read it in place. */
+
+struct stem_array
+{
+    PyObject_HEAD
+    char* data;
+    const char* format;     /* struct module format of one item */
+    Py_ssize_t shape[1];    /* number of items, for Py_buffer */
+    Py_ssize_t strides[1];  /* the item size */
+};
+
+static PyTypeObject StemArrayType = { PyVarObject_HEAD_INIT(NULL, 0) };
+
+/*  new_stem_array(length, itemsize, format) returns an uninitialised array,
+    or NULL with a Python error set */
+
+static stem_array* new_stem_array(Py_ssize_t length, Py_ssize_t itemsize, const char* format)
+{
+    stem_array* p_array = PyObject_New(stem_array, &StemArrayType);
+    if (p_array == NULL)
+        return NULL;
+    p_array->data = (char*)PyMem_Malloc(length > 0 ? length * itemsize : 1);
+    p_array->format = format;
+    p_array->shape[0] = length;
+    p_array->strides[0] = itemsize;
+    if (p_array->data == NULL)
+    {
+        Py_DECREF(p_array);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    return p_array;
+}
+
+static void stem_array_dealloc(PyObject* self)
+{
+    PyMem_Free(((stem_array*)self)->data);
+    PyObject_Del(self);
+}
+
+static Py_ssize_t stem_array_length(PyObject* self)
+{
+    return ((stem_array*)self)->shape[0];
+}
+
+static PyObject* stem_array_item(PyObject* self, Py_ssize_t idx)
+{
+    stem_array* p_array = (stem_array*)self;
+    if (idx < 0 || idx >= p_array->shape[0])
+    {
+        PyErr_SetString(PyExc_IndexError, "stem array index out of range");
+        return NULL;
+    }
+    const char* p_item = p_array->data + idx * p_array->strides[0];
+    switch (p_array->format[0])
+    {
+    case 'Q':
+        return PyLong_FromUnsignedLongLong(*(const uint64_t*)p_item);
+    case 'I':
+        return PyLong_FromUnsignedLong(*(const uint32_t*)p_item);
+    case 'q':
+        return PyLong_FromLongLong(*(const int64_t*)p_item);
+    default:
+        return PyLong_FromLong(*(const int32_t*)p_item);
+    }
+}
+
+static int stem_array_getbuffer(PyObject* self, Py_buffer* view, int flags)
+{
+    stem_array* p_array = (stem_array*)self;
+    if (flags & PyBUF_WRITABLE)
+    {
+        PyErr_SetString(PyExc_BufferError, "stem arrays are read only");
+        view->obj = NULL;
+        return -1;
+    }
+    view->obj = self;
+    Py_INCREF(self);
+    view->buf = p_array->data;
+    view->len = p_array->shape[0] * p_array->strides[0];
+    view->readonly = 1;
+    view->itemsize = p_array->strides[0];
+    view->format = (flags & PyBUF_FORMAT) ? (char*)p_array->format : NULL;
+    view->ndim = 1;
+    view->shape = (flags & PyBUF_ND) ? p_array->shape : NULL;
+    view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? p_array->strides : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+    return 0;
+}
+
+static PySequenceMethods StemArraySequence = { stem_array_length, 0, 0, stem_array_item };
+
+static PyBufferProcs StemArrayBuffer = { stem_array_getbuffer, NULL };
+
+/*  $KB: stem_hashes(words, seed) stems each word and hashes the stem in C, for
+    feature hashing pipelines that never need the stem as a string. The hash
+    is 64-bit FNV-1a over the stem's code points, started from the seed, run
+    through the splitmix64 finalizer so that the low bits used to pick a
+    bucket depend on every character. It only depends on the code points, so
+    it is stable across runs, platforms and str kinds, and an ascii bytes
+    word hashes like the equivalent str. */
+
+static inline uint64_t stem_hash_mix(uint64_t hash)
+{
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ull;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebull;
+    return hash ^ (hash >> 31);
+}
+
+template <typename CharT>
+static uint64_t stem_hash_chars(const CharT* str, int len, uint64_t seed)
+{
+    uint64_t hash = 14695981039346656037ull ^ seed;
+    for ( int i = 0; i < len; ++i )
+    {
+        hash ^= (uint64_t)str[i];
+        hash *= 1099511628211ull;
+    }
+    return stem_hash_mix(hash);
+}
+
+/*  stem_hash_kind(str, len, seed, plurals_only, p_hash) hashes the stem of
+    str[0] ... str[len-1]; returns FALSE with a Python error set on failure */
+
+template <typename CharT>
+static int stem_hash_kind(const CharT* str, Py_ssize_t len, uint64_t seed, int plurals_only, uint64_t* p_hash)
+{
+    CharT small[STEM_SMALL_WORD];
+    CharT* newstr = word_buffer(small, len);
+    if (newstr == NULL)
+        return FALSE;
+
+    int stem_len = stem_into(str, (int)len, newstr, plurals_only);
+    if (stem_len >= 0)
+        *p_hash = stem_hash_chars(newstr, stem_len, seed);
+    else
+        *p_hash = stem_hash_chars(str, (int)len, seed);
+    if (newstr != small)
+        scratch_trim<CharT>();
+    return TRUE;
+}
+
+static int stem_hash_word(PyObject* p_str_obj, uint64_t seed, int plurals_only, uint64_t* p_hash)
+{
+    if (PyBytes_Check(p_str_obj))
+        return stem_hash_kind((const unsigned char*)PyBytes_AS_STRING(p_str_obj),
+                              PyBytes_GET_SIZE(p_str_obj), seed, plurals_only, p_hash);
+    if (STEMMER_UNICODE_READY(p_str_obj) < 0)
+        return FALSE;
+
+    Py_ssize_t len = PyUnicode_GET_LENGTH(p_str_obj);
+    switch (PyUnicode_KIND(p_str_obj))
+    {
+    case PyUnicode_1BYTE_KIND:
+        return stem_hash_kind(PyUnicode_1BYTE_DATA(p_str_obj), len, seed, plurals_only, p_hash);
+    case PyUnicode_2BYTE_KIND:
+        return stem_hash_kind(PyUnicode_2BYTE_DATA(p_str_obj), len, seed, plurals_only, p_hash);
+    default:
+        return stem_hash_kind(PyUnicode_4BYTE_DATA(p_str_obj), len, seed, plurals_only, p_hash);
+    }
+}
+
+static PyObject* py_stem_hashes(PyObject* self, PyObject* args, PyObject* kwds)
+{
+    static const char* kwlist[] = {"words", "seed", "plurals_only", NULL};
+    PyObject* p_words_obj;
+    unsigned long long seed = 0;
+    int plurals_only = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|Ki:stem_hashes", (char**)kwlist,
+                                     &p_words_obj, &seed, &plurals_only))
+        return NULL;
+
+    PyObject* p_seq = PySequence_Fast(p_words_obj, "stem_hashes expects a sequence of str or bytes");
+    if (p_seq == NULL)
+        return NULL;
+
+    Py_ssize_t num_words = PySequence_Fast_GET_SIZE(p_seq);
+    PyObject** p_items = PySequence_Fast_ITEMS(p_seq);
+
+    stem_array* p_result = new_stem_array(num_words, sizeof(uint64_t), "Q");
+    if (p_result == NULL)
+    {
+        Py_DECREF(p_seq);
+        return NULL;
+    }
+
+    uint64_t* p_hashes = (uint64_t*)p_result->data;
+    for ( Py_ssize_t idx = 0; idx < num_words; ++idx )
+    {
+        if (!is_word(p_items[idx]))
+        {
+            PyErr_SetString(PyExc_TypeError, "stem_hashes expects a sequence of str or bytes");
+            break;
+        }
+        if (!stem_hash_word(p_items[idx], seed, plurals_only, &p_hashes[idx]))
+            break;
+    }
+
+    Py_DECREF(p_seq);
+    if (PyErr_Occurred())
+    {
+        Py_DECREF(p_result);
+        return NULL;
+    }
+    return (PyObject*)p_result;
+}
+
+/*  $KB: Vocabulary maps stems to dense int32 ids as a corpus is stemmed, so a
+    pipeline can go from tokens to ids in one C loop instead of stemming into
+    strings and probing a dict. The stems are kept like the stopwords: back
+    to back in an arena of code points, with an open addressing table of
+    (hash, id) slots at most half full on top. offsets[id] is where stem id
+    starts in the arena and offsets[id+1] where it ends.
+
+    Each add() call counts as one document: doc_freq[id] is the number of
+    documents stem id occurred in, and last_doc[id] the last one it was
+    counted for, so repeats within a document are counted once. */
+
+#define VOCAB_EMPTY 0xffffffffu
+#define VOCAB_MAX_IDS 0x7fffffff
+
+struct vocab_slot
+{
+    unsigned int hash;
+    unsigned int id;        /* VOCAB_EMPTY marks an unused slot */
+};
+
+struct VocabTable
+{
+    std::vector<Py_UCS4> arena;
+    std::vector<size_t> offsets;        /* one per id, plus the end of the arena */
+    std::vector<vocab_slot> slots;      /* empty, or a power of two in size */
+    std::vector<uint32_t> doc_freq;
+    std::vector<uint32_t> last_doc;
+    uint32_t num_docs;
+
+    VocabTable() : offsets(1, 0), num_docs(0) {}
+    size_t size() const { return offsets.size() - 1; }
+};
+
+static void vocab_grow(VocabTable* p_table)
+{
+    std::vector<vocab_slot> slots(p_table->slots.empty() ? 16 : 2 * p_table->slots.size());
+    for ( size_t idx = 0; idx < slots.size(); ++idx )
+        slots[idx].id = VOCAB_EMPTY;
+
+    size_t mask = slots.size() - 1;
+    for ( size_t idx = 0; idx < p_table->slots.size(); ++idx )
+    {
+        const vocab_slot& slot = p_table->slots[idx];
+        if (slot.id == VOCAB_EMPTY)
+            continue;
+        size_t pos = slot.hash & mask;
+        while (slots[pos].id != VOCAB_EMPTY)
+            pos = (pos + 1) & mask;
+        slots[pos] = slot;
+    }
+    p_table->slots.swap(slots);
+}
+
+/*  vocab_find(p_table, str, len, hash) returns the slot holding str, or the
+    empty slot where it would go. The table must have an empty slot. */
+
+template <typename CharT>
+static vocab_slot* vocab_find(VocabTable* p_table, const CharT* str, size_t len, unsigned int hash)
+{
+    size_t mask = p_table->slots.size() - 1;
+    for ( size_t idx = hash & mask; ; idx = (idx + 1) & mask )
+    {
+        vocab_slot* p_slot = &p_table->slots[idx];
+        if (p_slot->id == VOCAB_EMPTY)
+            return p_slot;
+        size_t start = p_table->offsets[p_slot->id];
+        if (p_slot->hash == hash && p_table->offsets[p_slot->id + 1] - start == len &&
+            same_chars(&p_table->arena[start], str, len))
+            return p_slot;
+    }
+}
+
+/*  vocab_id(p_table, str, len, add) returns the id of str, giving it the
+    next one if it is new and add is TRUE; -1 for an unknown word otherwise.
+    May throw bad_alloc. */
+
+template <typename CharT>
+static int32_t vocab_id(VocabTable* p_table, const CharT* str, size_t len, int add)
+{
+    if (p_table->slots.empty())
+    {
+        if (!add)
+            return -1;
+        vocab_grow(p_table);
+    }
+
+    unsigned int hash = stopword_hash(str, len);
+    vocab_slot* p_slot = vocab_find(p_table, str, len, hash);
+    if (p_slot->id != VOCAB_EMPTY)
+        return (int32_t)p_slot->id;
+    if (!add)
+        return -1;
+
+    size_t id = p_table->size();
+    p_table->arena.insert(p_table->arena.end(), str, str + len);
+    p_table->offsets.push_back(p_table->arena.size());
+    p_table->doc_freq.push_back(0);
+    p_table->last_doc.push_back(0);
+    p_slot->hash = hash;
+    p_slot->id = (unsigned int)id;
+    if (2 * p_table->size() > p_table->slots.size())
+        vocab_grow(p_table);
+    return (int32_t)id;
+}
+
+/*  vocab_word_kind(p_table, str, len, plurals_only, add, skip_stopwords)
+    stems str[0] ... str[len-1] and returns the stem's id as vocab_id does,
+    -1 for a stopword if skip_stopwords is TRUE, or -2 with a Python error set
+    if the word could not be stemmed. May throw bad_alloc. */
+
+template <typename CharT>
+static int32_t vocab_word_kind(VocabTable* p_table, const CharT* str, Py_ssize_t len,
+                               int plurals_only, int add, int skip_stopwords)
+{
+    if (skip_stopwords && is_stopword(stopwords_gil(), str, len))
+        return -1;
+
+    CharT small[STEM_SMALL_WORD];
+    CharT* newstr = word_buffer(small, len);
+    if (newstr == NULL)
+        return -2;
+
+    int stem_len = stem_into(str, (int)len, newstr, plurals_only);
+    int32_t id = (stem_len >= 0) ? vocab_id(p_table, newstr, stem_len, add)
+                                 : vocab_id(p_table, str, len, add);
+    if (newstr != small)
+        scratch_trim<CharT>();
+    return id;
+}
+
+static int32_t vocab_word(VocabTable* p_table, PyObject* p_str_obj, int plurals_only, int add,
+                          int skip_stopwords = FALSE)
+{
+    if (PyBytes_Check(p_str_obj))
+        return vocab_word_kind(p_table, (const unsigned char*)PyBytes_AS_STRING(p_str_obj),
+                               PyBytes_GET_SIZE(p_str_obj), plurals_only, add, skip_stopwords);
+    if (STEMMER_UNICODE_READY(p_str_obj) < 0)
+        return -2;
+
+    Py_ssize_t len = PyUnicode_GET_LENGTH(p_str_obj);
+    switch (PyUnicode_KIND(p_str_obj))
+    {
+    case PyUnicode_1BYTE_KIND:
+        return vocab_word_kind(p_table, PyUnicode_1BYTE_DATA(p_str_obj), len, plurals_only, add, skip_stopwords);
+    case PyUnicode_2BYTE_KIND:
+        return vocab_word_kind(p_table, PyUnicode_2BYTE_DATA(p_str_obj), len, plurals_only, add, skip_stopwords);
+    default:
+        return vocab_word_kind(p_table, PyUnicode_4BYTE_DATA(p_str_obj), len, plurals_only, add, skip_stopwords);
+    }
+}
+
+/*  vocab_count(p_table, id, doc) counts stem id as occurring in document doc,
+    once however many times it is seen there */
+
+static inline void vocab_count(VocabTable* p_table, int32_t id, uint32_t doc)
+{
+    if (p_table->last_doc[id] != doc)
+    {
+        p_table->last_doc[id] = doc;
+        ++p_table->doc_freq[id];
+    }
+}
+
+/*  $KB: a call that fails part way, on a bad word or out of memory, leaves
+    the vocabulary as it found it. vocab_uncount(p_table, num_ids, p_counted,
+    num_counted) takes back one document count per entry of p_counted, for
+    the ids below num_ids; vocab_truncate(p_table, num_ids, num_docs) then
+    drops the ids from num_ids on and puts num_docs back. The slots are
+    rebuilt in place, since taking ids out of a linear probing table would
+    break the chains of those that stay. Neither allocates. */
+
+static void vocab_uncount(VocabTable* p_table, size_t num_ids, const int32_t* p_counted, size_t num_counted)
+{
+    for ( size_t i = 0; i < num_counted; ++i )
+    {
+        size_t id = (size_t)p_counted[i];
+        if (id < num_ids)
+        {
+            --p_table->doc_freq[id];
+            p_table->last_doc[id] = 0;  /* no document yet to come */
+        }
+    }
+}
+
+static void vocab_truncate(VocabTable* p_table, size_t num_ids, uint32_t num_docs)
+{
+    p_table->num_docs = num_docs;
+    if (p_table->size() == num_ids)
+        return;
+    p_table->arena.resize(p_table->offsets[num_ids]);
+    p_table->offsets.resize(num_ids + 1);
+    p_table->doc_freq.resize(num_ids);
+    p_table->last_doc.resize(num_ids);
+
+    size_t mask = p_table->slots.size() - 1;
+    for ( size_t idx = 0; idx < p_table->slots.size(); ++idx )
+        p_table->slots[idx].id = VOCAB_EMPTY;
+    for ( size_t id = 0; id < num_ids; ++id )
+    {
+        size_t start = p_table->offsets[id];
+        unsigned int hash = stopword_hash(&p_table->arena[start], p_table->offsets[id + 1] - start);
+        size_t pos = hash & mask;
+        while (p_table->slots[pos].id != VOCAB_EMPTY)
+            pos = (pos + 1) & mask;
+        p_table->slots[pos].hash = hash;
+        p_table->slots[pos].id = (unsigned int)id;
+    }
+}
+
+struct vocabulary_object
+{
+    PyObject_HEAD
+    VocabTable* p_table;
+};
+
+static PyTypeObject VocabularyType = { PyVarObject_HEAD_INIT(NULL, 0) };
+
+static PyObject* vocabulary_new(PyTypeObject* type, PyObject* args, PyObject* kwds)
+{
+    if (!PyArg_ParseTuple(args, ":Vocabulary") || (kwds != NULL && PyDict_Size(kwds) != 0))
+    {
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_TypeError, "Vocabulary() takes no arguments");
+        return NULL;
+    }
+
+    vocabulary_object* self = (vocabulary_object*)type->tp_alloc(type, 0);
+    if (self == NULL)
+        return NULL;
+    self->p_table = new (std::nothrow) VocabTable;
+    if (self->p_table == NULL)
+    {
+        Py_DECREF(self);
+        return PyErr_NoMemory();
+    }
+    return (PyObject*)self;
+}
+
+static void vocabulary_dealloc(PyObject* self)
+{
+    delete ((vocabulary_object*)self)->p_table;
+    Py_TYPE(self)->tp_free(self);
+}
+
+static Py_ssize_t vocabulary_length(PyObject* self)
+{
+    return (Py_ssize_t)((vocabulary_object*)self)->p_table->size();
+}
+
+/*  vocabulary_ids(self, args, add) is add() and lookup(): the ids of a batch
+    of words as an int32 StemArray */
+
+static PyObject* vocabulary_ids(PyObject* self, PyObject* args, int add)
+{
+    VocabTable* p_table = ((vocabulary_object*)self)->p_table;
+    PyObject* p_words_obj;
+    int plurals_only = 0;
+
+    if (!PyArg_ParseTuple(args, add ? "O|i:add" : "O|i:lookup", &p_words_obj, &plurals_only))
+        return NULL;
+
+    PyObject* p_seq = PySequence_Fast(p_words_obj, "Vocabulary expects a sequence of str or bytes");
+    if (p_seq == NULL)
+        return NULL;
+
+    Py_ssize_t num_words = PySequence_Fast_GET_SIZE(p_seq);
+    PyObject** p_items = PySequence_Fast_ITEMS(p_seq);
+
+    stem_array* p_result = new_stem_array(num_words, sizeof(int32_t), "i");
+    if (p_result == NULL)
+    {
+        Py_DECREF(p_seq);
+        return NULL;
+    }
+
+    size_t num_ids = p_table->size();
+    uint32_t doc = p_table->num_docs + 1;
+    int32_t* p_ids = (int32_t*)p_result->data;
+    Py_ssize_t num_done = 0;
+    try
+    {
+        for ( Py_ssize_t idx = 0; idx < num_words; ++idx )
+        {
+            if (!is_word(p_items[idx]))
+            {
+                PyErr_SetString(PyExc_TypeError, "Vocabulary expects a sequence of str or bytes");
+                break;
+            }
+            if (add && p_table->size() >= VOCAB_MAX_IDS)
+            {
+                PyErr_SetString(PyExc_OverflowError, "vocabulary is full");
+                break;
+            }
+            int32_t id = vocab_word(p_table, p_items[idx], plurals_only, add);
+            if (id == -2)
+                break;
+            if (add)
+                vocab_count(p_table, id, doc);
+            p_ids[idx] = id;
+            num_done = idx + 1;
+        }
+    }
+    catch (const std::bad_alloc&)
+    {
+        PyErr_NoMemory();
+    }
+    if (add)
+        p_table->num_docs = doc;
+
+    Py_DECREF(p_seq);
+    if (PyErr_Occurred())
+    {
+        if (add)
+        {
+            /* the ids counted for this document have last_doc == doc, once */
+            for ( Py_ssize_t idx = 0; idx < num_done; ++idx )
+                if (p_table->last_doc[p_ids[idx]] == doc)
+                    vocab_uncount(p_table, num_ids, &p_ids[idx], 1);
+            vocab_truncate(p_table, num_ids, doc - 1);
+        }
+        Py_DECREF(p_result);
+        return NULL;
+    }
+    return (PyObject*)p_result;
+}
+
+static PyObject* vocabulary_add(PyObject* self, PyObject* args)
+{
+    return vocabulary_ids(self, args, TRUE);
+}
+
+static PyObject* vocabulary_lookup(PyObject* self, PyObject* args)
+{
+    return vocabulary_ids(self, args, FALSE);
+}
+
+static PyObject* vocabulary_stem(PyObject* self, PyObject* args)
+{
+    VocabTable* p_table = ((vocabulary_object*)self)->p_table;
+    Py_ssize_t id;
+
+    if (!PyArg_ParseTuple(args, "n:stem", &id))
+        return NULL;
+    if (id < 0 || (size_t)id >= p_table->size())
+    {
+        PyErr_SetString(PyExc_IndexError, "stem id out of range");
+        return NULL;
+    }
+
+    size_t start = p_table->offsets[id];
+    return PyUnicode_FromKindAndData(PyUnicode_4BYTE_KIND, p_table->arena.data() + start,
+                                     p_table->offsets[id + 1] - start);
+}
+
+static PyObject* vocabulary_doc_freq(PyObject* self, PyObject* args)
+{
+    VocabTable* p_table = ((vocabulary_object*)self)->p_table;
+    stem_array* p_result = new_stem_array(p_table->size(), sizeof(uint32_t), "I");
+    if (p_result == NULL)
+        return NULL;
+    if (p_table->size() > 0)
+        memcpy(p_result->data, p_table->doc_freq.data(), p_table->size() * sizeof(uint32_t));
+    return (PyObject*)p_result;
+}
+
+static PyObject* vocabulary_num_documents(PyObject* self, PyObject* args)
+{
+    return PyLong_FromUnsignedLong(((vocabulary_object*)self)->p_table->num_docs);
+}
+
+static PySequenceMethods VocabularySequence = { vocabulary_length };
+
+static PyMethodDef VocabularyMethods[] =
+{
+     {"add", vocabulary_add, METH_VARARGS, "add(words, plurals_only=0): stem a document's words, giving new stems the next free ids, and return their ids as an int32 StemArray. Counts as one document for doc_freq."},
+     {"lookup", vocabulary_lookup, METH_VARARGS, "lookup(words, plurals_only=0): like add, but unknown stems get id -1 and nothing is counted."},
+     {"stem", vocabulary_stem, METH_VARARGS, "stem(id): the stem with that id."},
+     {"doc_freq", vocabulary_doc_freq, METH_NOARGS, "the number of documents each stem occurred in, indexed by id, as a uint32 StemArray."},
+     {"num_documents", vocabulary_num_documents, METH_NOARGS, "the number of documents added so far."},
+     {NULL, NULL, 0, NULL}
+};
+
+/*  $KB: bag_of_words(documents, vocabulary) vectorizes a corpus of already
+    tokenized documents in one C loop: every token is stemmed, stopwords are
+    left out, and the stems are counted per document into a sparse matrix in
+    CSR form. Row d holds the stem ids indices[indptr[d]:indptr[d+1]], in
+    increasing order, and how often each occurred in counts[...]. indptr is
+    int64 since a large corpus has more than 2**31 entries. The columns are
+    the ids of the Vocabulary passed in, or of a new one, which grows as new
+    stems turn up and counts each document towards their doc_freq.
+
+    Counting uses a dense counts_by_id scratch table: each document touches
+    only its own ids and puts them back to zero, so no stem string and no
+    per-document hash table is ever made. */
+
+static int stem_array_from(const void* p_data, size_t length, Py_ssize_t itemsize,
+                           const char* format, PyObject** pp_array)
+{
+    stem_array* p_array = new_stem_array(length, itemsize, format);
+    if (p_array == NULL)
+        return FALSE;
+    if (length > 0)
+        memcpy(p_array->data, p_data, length * itemsize);
+    *pp_array = (PyObject*)p_array;
+    return TRUE;
+}
+
+static PyObject* py_bag_of_words(PyObject* self, PyObject* args, PyObject* kwds)
+{
+    static const char* kwlist[] = {"documents", "vocabulary", "plurals_only", NULL};
+    PyObject* p_docs_obj;
+    PyObject* p_vocab_obj = Py_None;
+    int plurals_only = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|Oi:bag_of_words", (char**)kwlist,
+                                     &p_docs_obj, &p_vocab_obj, &plurals_only))
+        return NULL;
+
+    if (p_vocab_obj == Py_None)
+    {
+        p_vocab_obj = PyObject_CallObject((PyObject*)&VocabularyType, NULL);
+        if (p_vocab_obj == NULL)
+            return NULL;
+    }
+    else if (PyObject_TypeCheck(p_vocab_obj, &VocabularyType))
+    {
+        Py_INCREF(p_vocab_obj);
+    }
+    else
+    {
+        PyErr_SetString(PyExc_TypeError, "bag_of_words expects a Vocabulary or None");
+        return NULL;
+    }
+    VocabTable* p_table = ((vocabulary_object*)p_vocab_obj)->p_table;
+
+    /* an owned snapshot: iterating a document runs Python code, which could
+       change a list of documents under us */
+    PyObject* p_seq = PySequence_Fast(p_docs_obj, "bag_of_words expects a sequence of documents");
+    PyObject* p_docs = p_seq == NULL ? NULL : PySequence_Tuple(p_seq);
+    Py_XDECREF(p_seq);
+    if (p_docs == NULL)
+    {
+        Py_DECREF(p_vocab_obj);
+        return NULL;
+    }
+
+    Py_ssize_t num_docs = PyTuple_GET_SIZE(p_docs);
+    size_t num_ids = p_table->size();
+    uint32_t num_vocab_docs = p_table->num_docs;
+    std::vector<int64_t> indptr;
+    std::vector<int32_t> indices;
+    std::vector<int32_t> counts;
+    std::vector<int32_t> counts_by_id;
+    std::vector<int32_t> doc_ids;       /* distinct ids of the current document */
+    try
+    {
+        indptr.reserve(num_docs + 1);
+        indptr.push_back(0);
+        for ( Py_ssize_t doc_idx = 0; doc_idx < num_docs && !PyErr_Occurred(); ++doc_idx )
+        {
+            /* a str is a sequence too, but of letters, not words */
+            PyObject* p_doc_obj = PyTuple_GET_ITEM(p_docs, doc_idx);
+            if (PyUnicode_Check(p_doc_obj) || PyBytes_Check(p_doc_obj))
+            {
+                PyErr_SetString(PyExc_TypeError, "bag_of_words expects each document to be a sequence of str or bytes, not a single word");
+                break;
+            }
+            PyObject* p_words = PySequence_Fast(p_doc_obj,
+                                                "bag_of_words expects each document to be a sequence of str or bytes");
+            if (p_words == NULL)
+                break;
+
+            uint32_t doc = ++p_table->num_docs;
+            Py_ssize_t num_words = PySequence_Fast_GET_SIZE(p_words);
+            PyObject** p_items = PySequence_Fast_ITEMS(p_words);
+            for ( Py_ssize_t idx = 0; idx < num_words; ++idx )
+            {
+                if (!is_word(p_items[idx]))
+                {
+                    PyErr_SetString(PyExc_TypeError, "bag_of_words expects each document to be a sequence of str or bytes");
+                    break;
+                }
+                if (p_table->size() >= VOCAB_MAX_IDS)
+                {
+                    PyErr_SetString(PyExc_OverflowError, "vocabulary is full");
+                    break;
+                }
+                int32_t id = vocab_word(p_table, p_items[idx], plurals_only, TRUE, TRUE);
+                if (id == -2)
+                    break;
+                if (id == -1)
+                    continue; /* a stopword */
+
+                if ((size_t)id >= counts_by_id.size())
+                    counts_by_id.resize(p_table->size() + p_table->size() / 2 + 1, 0);
+                if (counts_by_id[id]++ == 0)
+                {
+                    doc_ids.push_back(id);
+                    vocab_count(p_table, id, doc);
+                }
+            }
+            Py_DECREF(p_words);
+
+            std::sort(doc_ids.begin(), doc_ids.end());
+            /* so that an id is never in both doc_ids and indices */
+            indices.reserve(indices.size() + doc_ids.size());
+            counts.reserve(counts.size() + doc_ids.size());
+            for ( size_t i = 0; i < doc_ids.size(); ++i )
+            {
+                indices.push_back(doc_ids[i]);
+                counts.push_back(counts_by_id[doc_ids[i]]);
+                counts_by_id[doc_ids[i]] = 0;
+            }
+            doc_ids.clear();
+            indptr.push_back((int64_t)indices.size());
+        }
+    }
+    catch (const std::bad_alloc&)
+    {
+        PyErr_NoMemory();
+    }
+    Py_DECREF(p_docs);
+    if (PyErr_Occurred())
+    {
+        vocab_uncount(p_table, num_ids, indices.data(), indices.size());
+        vocab_uncount(p_table, num_ids, doc_ids.data(), doc_ids.size());
+        vocab_truncate(p_table, num_ids, num_vocab_docs);
+    }
+
+    PyObject* p_indptr = NULL;
+    PyObject* p_indices = NULL;
+    PyObject* p_counts = NULL;
+    PyObject* p_result = NULL;
+    if (!PyErr_Occurred() &&
+        stem_array_from(indptr.data(), indptr.size(), sizeof(int64_t), "q", &p_indptr) &&
+        stem_array_from(indices.data(), indices.size(), sizeof(int32_t), "i", &p_indices) &&
+        stem_array_from(counts.data(), counts.size(), sizeof(int32_t), "i", &p_counts))
+    {
+        p_result = PyTuple_Pack(4, p_indptr, p_indices, p_counts, p_vocab_obj);
+    }
+    Py_XDECREF(p_indptr);
+    Py_XDECREF(p_indices);
+    Py_XDECREF(p_counts);
+    Py_DECREF(p_vocab_obj);
+    return p_result;
+}
+
+/*  $KB: stem_text(text) stems raw text in a single pass: it finds the words,
+    lower cases their ascii letters, skips the stemmer for stopwords and
+    stems the rest, returning the stems as a list or joined by spaces. A word
+    is a maximal run of letters and digits (Py_UNICODE_ISALNUM; for bytes,
+    ascii ones only); everything else separates words and is dropped.
+
+    Each word is copied once, lower cased on the way, straight into the
+    buffer the stemmer works in, which in join mode is the joined result
+    itself. The result strs are sized from an OR of their characters: its
+    highest bit is that of the widest character, which is all PyUnicode_New
+    needs to pick the narrowest kind. */
+
+template <typename CharT>
+static inline bool is_text_char(CharT ch, bool is_bytes)
+{
+    if (ch < 128)
+        return porter_word_char((unsigned)ch) != 0;
+    return !is_bytes && Py_UNICODE_ISALNUM((Py_UCS4)ch);
+}
+
+/*  $KB: with SSE2 or NEON the scanner classifies TEXT_BLOCK code units at a
+    time. text_block(p, &word, &other) sets bit i of word if p[i] is an ascii
+    letter or digit, and bit i of other if p[i] is not ascii at all. Wider
+    code units are first narrowed to bytes, anything past ascii becoming a
+    byte with the top bit set. Only the code units flagged in other, which
+    may or may not be letters, go through Py_UNICODE_ISALNUM one at a time;
+    plain ascii text never leaves the vector path. */
+
+#if defined(STEMMER_SSE2) || defined(STEMMER_NEON)
+#define TEXT_BLOCK 16
+
+static inline int lowest_bit(unsigned x)
+{
+#if defined(__GNUC__)
+    return __builtin_ctz(x);
+#else
+    int n = 0;
+    while (n < 32 && !(x & 1))
+        x >>= 1, ++n;
+    return n;
+#endif
+}
+#endif
+
+#if defined(STEMMER_SSE2)
+
+/* the code units that aren't ascii become 0x80, so they fit a signed pack */
+static inline __m128i ascii_or_0x80_16(__m128i v)
+{
+    __m128i ascii = _mm_cmpeq_epi16(_mm_and_si128(v, _mm_set1_epi16((short)0xff80)), _mm_setzero_si128());
+    return _mm_or_si128(_mm_and_si128(ascii, v), _mm_andnot_si128(ascii, _mm_set1_epi16(0x80)));
+}
+
+static inline __m128i ascii_or_0x80_32(__m128i v)
+{
+    __m128i ascii = _mm_cmpeq_epi32(_mm_and_si128(v, _mm_set1_epi32(~0x7f)), _mm_setzero_si128());
+    return _mm_or_si128(_mm_and_si128(ascii, v), _mm_andnot_si128(ascii, _mm_set1_epi32(0x80)));
+}
+
+template <typename CharT>
+static inline __m128i text_load(const CharT* p)
+{
+    const __m128i* q = (const __m128i*)p;
+    if (sizeof(CharT) == 1)
+        return _mm_loadu_si128(q);
+    if (sizeof(CharT) == 2)
+        return _mm_packus_epi16(ascii_or_0x80_16(_mm_loadu_si128(q)),
+                                ascii_or_0x80_16(_mm_loadu_si128(q + 1)));
+    return _mm_packus_epi16(_mm_packs_epi32(ascii_or_0x80_32(_mm_loadu_si128(q)),
+                                            ascii_or_0x80_32(_mm_loadu_si128(q + 1))),
+                            _mm_packs_epi32(ascii_or_0x80_32(_mm_loadu_si128(q + 2)),
+                                            ascii_or_0x80_32(_mm_loadu_si128(q + 3))));
+}
+
+/*  x - lo <= hi - lo unsigned, as a signed compare after moving lo to -128 */
+static inline __m128i bytes_in_range(__m128i v, char lo, char hi)
+{
+    return _mm_cmplt_epi8(_mm_add_epi8(v, _mm_set1_epi8((char)(0x80 - lo))),
+                          _mm_set1_epi8((char)(-128 + (hi - lo + 1))));
+}
+
+template <typename CharT>
+static inline void text_block(const CharT* p, unsigned* p_word, unsigned* p_other)
+{
+    __m128i v = text_load(p);
+    __m128i letter = bytes_in_range(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 'z');
+    __m128i digit = bytes_in_range(v, '0', '9');
+    *p_word = (unsigned)_mm_movemask_epi8(_mm_or_si128(letter, digit));
+    *p_other = (unsigned)_mm_movemask_epi8(v);
+}
+
+/*  fold_block(p_dst, p_src) lower cases 16 bytes, returning a bit per byte
+    that is not ascii */
+static inline unsigned fold_block(unsigned char* p_dst, const unsigned char* p_src)
+{
+    __m128i v = _mm_loadu_si128((const __m128i*)p_src);
+    __m128i upper = bytes_in_range(v, 'A', 'Z');
+    v = _mm_add_epi8(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+    _mm_storeu_si128((__m128i*)p_dst, v);
+    return (unsigned)_mm_movemask_epi8(v);
+}
+
+#elif defined(STEMMER_NEON)
+
+static inline unsigned neon_movemask(uint8x16_t m)
+{
+    static const uint8_t weights[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+    uint64x2_t sums = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(vandq_u8(m, vld1q_u8(weights)))));
+    return (unsigned)vgetq_lane_u64(sums, 0) | ((unsigned)vgetq_lane_u64(sums, 1) << 8);
+}
+
+/* saturating narrows keep anything past ascii at 0x80 or above */
+template <typename CharT>
+static inline uint8x16_t text_load(const CharT* p)
+{
+    if (sizeof(CharT) == 1)
+        return vld1q_u8((const uint8_t*)p);
+    if (sizeof(CharT) == 2)
+        return vcombine_u8(vqmovn_u16(vld1q_u16((const uint16_t*)p)),
+                           vqmovn_u16(vld1q_u16((const uint16_t*)p + 8)));
+    const uint32_t* q = (const uint32_t*)p;
+    return vcombine_u8(vqmovn_u16(vcombine_u16(vqmovn_u32(vld1q_u32(q)), vqmovn_u32(vld1q_u32(q + 4)))),
+                       vqmovn_u16(vcombine_u16(vqmovn_u32(vld1q_u32(q + 8)), vqmovn_u32(vld1q_u32(q + 12)))));
+}
+
+template <typename CharT>
+static inline void text_block(const CharT* p, unsigned* p_word, unsigned* p_other)
+{
+    uint8x16_t v = text_load(p);
+    uint8x16_t letter = vcltq_u8(vsubq_u8(vorrq_u8(v, vdupq_n_u8(0x20)), vdupq_n_u8('a')), vdupq_n_u8(26));
+    uint8x16_t digit = vcltq_u8(vsubq_u8(v, vdupq_n_u8('0')), vdupq_n_u8(10));
+    *p_word = neon_movemask(vorrq_u8(letter, digit));
+    *p_other = neon_movemask(vcgeq_u8(v, vdupq_n_u8(0x80)));
+}
+
+static inline unsigned fold_block(unsigned char* p_dst, const unsigned char* p_src)
+{
+    uint8x16_t v = vld1q_u8(p_src);
+    uint8x16_t upper = vcltq_u8(vsubq_u8(v, vdupq_n_u8('A')), vdupq_n_u8(26));
+    v = vaddq_u8(v, vandq_u8(upper, vdupq_n_u8(0x20)));
+    vst1q_u8(p_dst, v);
+    return neon_movemask(vcgeq_u8(v, vdupq_n_u8(0x80)));
+}
+
+#endif
+
+/*  text_word_start(text, pos, len, is_bytes) is the first position from pos
+    on where a word starts, or len; text_word_end(...) is the first position
+    from pos on that is not part of a word. */
+
+template <typename CharT>
+static Py_ssize_t text_word_start(const CharT* text, Py_ssize_t pos, Py_ssize_t len, bool is_bytes)
+{
+#ifdef TEXT_BLOCK
+    for ( ; pos + TEXT_BLOCK <= len; pos += TEXT_BLOCK )
+    {
+        unsigned word, other;
+        text_block(text + pos, &word, &other);
+        for ( unsigned candidates = word | (is_bytes ? 0 : other); candidates != 0; candidates &= candidates - 1 )
+        {
+            int i = lowest_bit(candidates);
+            if (((word >> i) & 1) || Py_UNICODE_ISALNUM((Py_UCS4)text[pos + i]))
+                return pos + i;
+        }
+    }
+#endif
+    while (pos < len && !is_text_char(text[pos], is_bytes))
+        ++pos;
+    return pos;
+}
+
+template <typename CharT>
+static Py_ssize_t text_word_end(const CharT* text, Py_ssize_t pos, Py_ssize_t len, bool is_bytes)
+{
+#ifdef TEXT_BLOCK
+    for ( ; pos + TEXT_BLOCK <= len; pos += TEXT_BLOCK )
+    {
+        unsigned word, other;
+        text_block(text + pos, &word, &other);
+        for ( unsigned stops = ~word & 0xffff; stops != 0; stops &= stops - 1 )
+        {
+            int i = lowest_bit(stops);
+            if (is_bytes || !((other >> i) & 1) || !Py_UNICODE_ISALNUM((Py_UCS4)text[pos + i]))
+                return pos + i;
+        }
+    }
+#endif
+    while (pos < len && is_text_char(text[pos], is_bytes))
+        ++pos;
+    return pos;
+}
+
+/*  text_fold(p_dst, p_src, len, avail) copies a word of len code units and
+    lower cases its ascii letters, returning the OR of its code units (or
+    just 0x80 for any byte past ascii). p_src may be read up to avail code
+    units, and p_dst written to len rounded up to TEXT_BLOCK. */
+
+#define TEXT_FOLD_SLACK 16
+
+template <typename CharT>
+static inline Py_UCS4 text_fold(CharT* p_dst, const CharT* p_src, int len, Py_ssize_t avail)
+{
+    Py_UCS4 char_or = 0;
+    int i = 0;
+#ifdef TEXT_BLOCK
+    if (sizeof(CharT) == 1)
+    {
+        for ( ; i < len && i + TEXT_BLOCK <= avail; i += TEXT_BLOCK )
+        {
+            unsigned other = fold_block((unsigned char*)p_dst + i, (const unsigned char*)p_src + i);
+            if (len - i < TEXT_BLOCK)
+                other &= (1u << (len - i)) - 1;
+            if (other != 0)
+                char_or = 0x80;
+        }
+        if (i >= len)
+            return char_or;
+    }
+#endif
+    for ( ; i < len; ++i )
+    {
+        CharT ch = p_src[i];
+        if ((unsigned)(ch - 'A') < 26)
+            ch |= 0x20;
+        p_dst[i] = ch;
+        char_or |= ch;
+    }
+    return char_or;
+}
+
+/*  text_token(p_chars, len, is_bytes, char_or) makes a str (or bytes) of
+    p_chars[0] ... p_chars[len-1], whose characters OR to char_or */
+
+template <typename CharT>
+static PyObject* text_token(const CharT* p_chars, size_t len, bool is_bytes, Py_UCS4 char_or)
+{
+    if (is_bytes)
+        return PyBytes_FromStringAndSize((const char*)p_chars, len);
+
+    PyObject* token = PyUnicode_New(len, char_or > 0xffff ? 0x10ffff : char_or);
+    if (token == NULL)
+        return NULL;
+    int kind = PyUnicode_KIND(token);
+    void* p_data = PyUnicode_DATA(token);
+    if (kind == sizeof(CharT))
+        memcpy(p_data, p_chars, len * sizeof(CharT));
+    else
+        for ( size_t i = 0; i < len; ++i )
+            PyUnicode_WRITE(kind, p_data, i, p_chars[i]);
+    return token;
+}
+
+template <typename CharT>
+static PyObject* stem_text_kind(const CharT* text, Py_ssize_t text_len, bool is_bytes,
+                                int join, int plurals_only)
+{
+    PyObject* p_result = join ? NULL : PyList_New(0);
+    if (!join && p_result == NULL)
+        return NULL;
+
+    std::vector<CharT> word;
+    std::vector<CharT> joined;
+    size_t joined_len = 0;
+    Py_UCS4 joined_or = 0;
+    try
+    {
+        for ( Py_ssize_t pos = text_word_start(text, 0, text_len, is_bytes); pos < text_len;
+              pos = text_word_start(text, pos, text_len, is_bytes) )
+        {
+            Py_ssize_t start = pos;
+            pos = text_word_end(text, pos, text_len, is_bytes);
+            if (pos - start > INT_MAX)
+            {
+                PyErr_SetString(PyExc_OverflowError, "word is too long to stem");
+                break;
+            }
+            int len = (int)(pos - start);
+
+            /* fold the word into where it is stemmed: the end of the joined
+               text, or the word buffer */
+            CharT* p_word;
+            if (join)
+            {
+                if (joined_len > 0)
+                    joined_len += 1;
+                if (joined.size() < joined_len + len + TEXT_FOLD_SLACK)
+                    joined.resize(2 * (joined_len + len + TEXT_FOLD_SLACK));
+                if (joined_len > 0)
+                    joined[joined_len - 1] = ' ';
+                p_word = joined.data() + joined_len;
+            }
+            else
+            {
+                if (word.size() < (size_t)len + TEXT_FOLD_SLACK)
+                    word.resize(len + TEXT_FOLD_SLACK);
+                p_word = word.data();
+            }
+            Py_UCS4 char_or = text_fold(p_word, text + start, len, text_len - start);
+
+            int stem_len = len;
+            if (!is_stopword(stopwords_gil(), p_word, len))
+                stem_len = (int)porter::stem_in_place(p_word, len, plurals_only);
+
+            if (join)
+            {
+                joined_len += stem_len;
+                joined_or |= char_or;
+                continue;
+            }
+            PyObject* token = text_token(p_word, stem_len, is_bytes, char_or);
+            if (token == NULL)
+                break;
+            int failed = PyList_Append(p_result, token);
+            Py_DECREF(token);
+            if (failed)
+                break;
+        }
+    }
+    catch (const std::bad_alloc&)
+    {
+        PyErr_NoMemory();
+    }
+
+    if (join && !PyErr_Occurred())
+        p_result = text_token(joined.data(), joined_len, is_bytes, joined_or | ' ');
+    if (PyErr_Occurred())
+        Py_CLEAR(p_result);
+    return p_result;
+}
+
+static PyObject* py_stem_text(PyObject* self, PyObject* args, PyObject* kwds)
+{
+    static const char* kwlist[] = {"text", "join", "plurals_only", NULL};
+    PyObject* p_text_obj;
+    int join = 0;
+    int plurals_only = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|pi:stem_text", (char**)kwlist,
+                                     &p_text_obj, &join, &plurals_only))
+        return NULL;
+
+    if (PyBytes_Check(p_text_obj))
+        return stem_text_kind((const unsigned char*)PyBytes_AS_STRING(p_text_obj),
+                              PyBytes_GET_SIZE(p_text_obj), true, join, plurals_only);
+    if (!PyUnicode_Check(p_text_obj))
+    {
+        PyErr_SetString(PyExc_TypeError, "stem_text expects a str or bytes argument");
+        return NULL;
+    }
+    if (STEMMER_UNICODE_READY(p_text_obj) < 0)
+        return NULL;
+
+    Py_ssize_t len = PyUnicode_GET_LENGTH(p_text_obj);
+    switch (PyUnicode_KIND(p_text_obj))
+    {
+    case PyUnicode_1BYTE_KIND:
+        return stem_text_kind(PyUnicode_1BYTE_DATA(p_text_obj), len, false, join, plurals_only);
+    case PyUnicode_2BYTE_KIND:
+        return stem_text_kind(PyUnicode_2BYTE_DATA(p_text_obj), len, false, join, plurals_only);
+    default:
+        return stem_text_kind(PyUnicode_4BYTE_DATA(p_text_obj), len, false, join, plurals_only);
+    }
+}
+
+/*  stopword_add(p_table, p_str_obj) and stopword_remove(p_table, p_str_obj)
+    add or remove the str p_str_obj in whatever kind it is stored; TRUE if
+    that changed the table. An added word must fit. */
+
+static bool stopword_add(StopwordTable* p_table, PyObject* p_str_obj)
+{
+    Py_ssize_t len = PyUnicode_GET_LENGTH(p_str_obj);
+    switch (PyUnicode_KIND(p_str_obj))
+    {
+    case PyUnicode_1BYTE_KIND:
+        return stopword_insert(p_table, PyUnicode_1BYTE_DATA(p_str_obj), len);
+    case PyUnicode_2BYTE_KIND:
+        return stopword_insert(p_table, PyUnicode_2BYTE_DATA(p_str_obj), len);
+    default:
+        return stopword_insert(p_table, PyUnicode_4BYTE_DATA(p_str_obj), len);
+    }
+}
+
+static bool stopword_remove(StopwordTable* p_table, PyObject* p_str_obj)
+{
+    Py_ssize_t len = PyUnicode_GET_LENGTH(p_str_obj);
+    switch (PyUnicode_KIND(p_str_obj))
+    {
+    case PyUnicode_1BYTE_KIND:
+        return stopword_erase(p_table, PyUnicode_1BYTE_DATA(p_str_obj), len);
+    case PyUnicode_2BYTE_KIND:
+        return stopword_erase(p_table, PyUnicode_2BYTE_DATA(p_str_obj), len);
+    default:
+        return stopword_erase(p_table, PyUnicode_4BYTE_DATA(p_str_obj), len);
+    }
+}
+
+/*  stopword_tuple(p_words_obj, p_error, p_arena_len) returns the strs of
+    the sequence p_words_obj as a tuple, a snapshot in case the sequence
+    changes while the GIL is released, and sets *p_arena_len to the arena
+    space they take. Returns NULL with p_error raised as a TypeError if
+    there is anything but strs in it. */
+
+static PyObject* stopword_tuple(PyObject* p_words_obj, const char* p_error, size_t* p_arena_len)
+{
+    PyObject* p_words = PySequence_Tuple(p_words_obj);
+    if (p_words == NULL)
+        return NULL;
+
+    size_t arena_len = 0;
+    for ( Py_ssize_t idx = 0; idx < PyTuple_GET_SIZE(p_words); ++idx )
+    {
+        PyObject* p_str_obj = PyTuple_GET_ITEM(p_words, idx);
+        if (PyUnicode_Check(p_str_obj) == 0)
+        {
+            PyErr_SetString(PyExc_TypeError, p_error);
+            Py_DECREF(p_words);
+            return NULL;
+        }
+        if (STEMMER_UNICODE_READY(p_str_obj) < 0)
+        {
+            Py_DECREF(p_words);
+            return NULL;
+        }
+        arena_len += PyUnicode_GET_LENGTH(p_str_obj) + 2;
+    }
+    *p_arena_len = arena_len;
+    return p_words;
+}
+
+/*  $KB: a change to the stopwords holds the GIL only to check its argument
+    and to swap a new table in. Everything else, building or changing the
+    table, waiting for the C API's readers of an old one and freeing it,
+    happens with the GIL released, so not even a big list stalls the
+    threads that are stemming. Strs are immutable and the snapshot tuple
+    keeps them alive, so reading them needs no GIL either.
+
+    g_stopword_writer is only ever waited for without the GIL.
+    stopword_replace(pp_thread, p_table) is called with it held and the
+    thread state saved in *pp_thread; it takes the GIL back just for the
+    swap, and frees the old table once no reader can still be using it. */
+
+static void stopword_replace(PyThreadState** pp_thread, StopwordTable* p_table)
+{
+    PyEval_RestoreThread(*pp_thread);
+    StopwordTable* p_old = stopword_publish(p_table);
+    *pp_thread = PyEval_SaveThread();
+    stopword_synchronize();
+    if (p_old != &g_no_stopwords)
+        delete p_old;
+}
+
+static PyObject* py_set_stopwords(PyObject* self, PyObject* args)
+{
+    PyObject * p_list_obj; /* the list of strings */
+
+    if (! PyArg_ParseTuple( args, "O!", &PyList_Type, &p_list_obj ))
+        return NULL;
+
+    size_t arena_len;
+    PyObject* p_words = stopword_tuple(p_list_obj, "set_stopwords expects a list of str", &arena_len);
+    if (p_words == NULL)
+        return NULL;
+    Py_ssize_t num_words = PyTuple_GET_SIZE(p_words);
+
+    /* sized up front, with room to spare for add_stopwords */
+    PyThreadState* p_thread = PyEval_SaveThread();
+    g_stopword_writer.lock();
+    StopwordTable* p_table = stopword_new(STOPWORD_HEADROOM(num_words), STOPWORD_HEADROOM(arena_len));
+    if (p_table != NULL)
+    {
+        for ( Py_ssize_t idx = 0; idx < num_words; ++idx )
+            stopword_add(p_table, PyTuple_GET_ITEM(p_words, idx));
+        stopword_replace(&p_thread, p_table);
+    }
+    g_stopword_writer.unlock();
+    PyEval_RestoreThread(p_thread);
+    Py_DECREF(p_words);
+    if (p_table == NULL)
+        return PyErr_NoMemory();
+
+    /* cached stems were computed against the old stopwords */
+    cache_clear();
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/*  $KB: add_stopwords and remove_stopwords cost in proportion to the words
+    they are given, not to the whole list: both change the current table in
+    place. Only an addition that outgrows the table builds a new one, twice
+    the size of its live words, so that cost is amortised over at least as
+    many additions again. Cached stems are dropped for the words changed
+    and no others. */
+
+static PyObject* py_add_stopwords(PyObject* self, PyObject* p_words_obj)
+{
+    size_t arena_len;
+    PyObject* p_words = stopword_tuple(p_words_obj, "add_stopwords expects a sequence of str", &arena_len);
+    if (p_words == NULL)
+        return NULL;
+    Py_ssize_t num_words = PyTuple_GET_SIZE(p_words);
+
+    Py_ssize_t added = 0;
+    bool no_memory = false;
+    PyThreadState* p_thread = PyEval_SaveThread();
+    g_stopword_writer.lock();
+    StopwordTable* p_current = g_stopwords.load();
+    StopwordTable* p_table = p_current;
+    for ( Py_ssize_t idx = 0; idx < num_words; ++idx )
+    {
+        PyObject* p_str_obj = PyTuple_GET_ITEM(p_words, idx);
+        size_t len = PyUnicode_GET_LENGTH(p_str_obj);
+        if (!stopword_fits(p_table, len))
+        {
+            /* with room for all the words still to come, so once at most */
+            StopwordTable* p_grown = stopword_grow(p_table, num_words - idx, arena_len);
+            if (p_grown == NULL)
+            {
+                no_memory = true;
+                break;
+            }
+            if (p_table != p_current)
+                delete p_table;
+            p_table = p_grown;
+        }
+        added += stopword_add(p_table, p_str_obj);
+        arena_len -= len + 2;
+    }
+    if (p_table != p_current)
+        stopword_replace(&p_thread, p_table);
+    g_stopword_writer.unlock();
+    PyEval_RestoreThread(p_thread);
+
+    for ( Py_ssize_t idx = 0; idx < num_words; ++idx )
+        cache_forget(PyTuple_GET_ITEM(p_words, idx));
+    Py_DECREF(p_words);
+    if (no_memory)
+        return PyErr_NoMemory();
+    return PyLong_FromSsize_t(added);
+}
+
+static PyObject* py_remove_stopwords(PyObject* self, PyObject* p_words_obj)
+{
+    size_t arena_len;
+    PyObject* p_words = stopword_tuple(p_words_obj, "remove_stopwords expects a sequence of str", &arena_len);
+    if (p_words == NULL)
+        return NULL;
+    Py_ssize_t num_words = PyTuple_GET_SIZE(p_words);
+
+    Py_ssize_t removed = 0;
+    Py_BEGIN_ALLOW_THREADS
+    g_stopword_writer.lock();
+    StopwordTable* p_table = g_stopwords.load();
+    for ( Py_ssize_t idx = 0; idx < num_words; ++idx )
+        removed += stopword_remove(p_table, PyTuple_GET_ITEM(p_words, idx));
+    g_stopword_writer.unlock();
+    Py_END_ALLOW_THREADS
+
+    for ( Py_ssize_t idx = 0; idx < num_words; ++idx )
+        cache_forget(PyTuple_GET_ITEM(p_words, idx));
+    Py_DECREF(p_words);
+    return PyLong_FromSsize_t(removed);
+}
+
+/*  $KB: load_stopwords replaces the stopwords with those in a file, which
+    is either a text file, one word per line in UTF-8, or an image written
+    by save_stopwords. A text file is read and hashed natively, without a
+    str per word; an image is mapped and used as it is, so a big list costs
+    no more to load than its size in page faults, and workers forked after
+    the load share its pages. Like set_stopwords, the file is read and the
+    table built with the GIL released. */
+
+static PyObject* py_load_stopwords(PyObject* self, PyObject* args)
+{
+    PyObject* p_path_obj;   /* bytes, from PyUnicode_FSConverter */
+
+    if (! PyArg_ParseTuple( args, "O&", PyUnicode_FSConverter, &p_path_obj ))
+        return NULL;
+    const char* path = PyBytes_AS_STRING(p_path_obj);
+
+    StopwordTable* p_table = NULL;
+    int error = 0;
+    size_t line = 0;
+    int status;
+    PyThreadState* p_thread = PyEval_SaveThread();
+    g_stopword_writer.lock();
+    status = stopword_load(path, &p_table, &error, &line);
+    size_t count = status == STOPWORD_LOAD_OK ? p_table->count.load() : 0;
+    if (status == STOPWORD_LOAD_OK)
+        stopword_replace(&p_thread, p_table);
+    g_stopword_writer.unlock();
+    PyEval_RestoreThread(p_thread);
+
+    PyObject* p_result = NULL;
+    switch (status)
+    {
+    case STOPWORD_LOAD_OK:
+        cache_clear();
+        p_result = PyLong_FromSize_t(count);
+        break;
+    case STOPWORD_LOAD_OS_ERROR:
+        errno = error;
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, p_path_obj);
+        break;
+    case STOPWORD_LOAD_NO_MEMORY:
+        PyErr_NoMemory();
+        break;
+    case STOPWORD_LOAD_BAD_TEXT:
+        PyErr_Format(PyExc_ValueError, "%s, line %zu: not valid UTF-8", path, line);
+        break;
+    default:
+        PyErr_Format(PyExc_ValueError, "%s: not a stopword image this module can use", path);
+        break;
+    }
+    Py_DECREF(p_path_obj);
+    return p_result;
+}
+
+/*  save_stopwords writes the image to path + ".tmp" and renames it over
+    path, so a process that has the old image mapped keeps its pages and
+    one loading meanwhile never sees half a file. */
+
+static PyObject* py_save_stopwords(PyObject* self, PyObject* args)
+{
+    PyObject* p_path_obj;
+
+    if (! PyArg_ParseTuple( args, "O&", PyUnicode_FSConverter, &p_path_obj ))
+        return NULL;
+    std::string tmp_path;
+    try
+    {
+        tmp_path = std::string(PyBytes_AS_STRING(p_path_obj)) + ".tmp";
+    }
+    catch (const std::bad_alloc&)
+    {
+        Py_DECREF(p_path_obj);
+        return PyErr_NoMemory();
+    }
+
+    int error = 0;
+    Py_BEGIN_ALLOW_THREADS
+    g_stopword_writer.lock();
+    FILE* p_file = fopen(tmp_path.c_str(), "wb");
+    if (p_file == NULL)
+        error = errno;
+    else
+    {
+        if (stopword_image(g_stopwords.load(), p_file) != 0)
+            error = errno;
+        if (fclose(p_file) != 0 && error == 0)
+            error = errno;
+        if (error == 0 && rename(tmp_path.c_str(), PyBytes_AS_STRING(p_path_obj)) != 0)
+            error = errno;
+        if (error != 0)
+            remove(tmp_path.c_str());
+    }
+    g_stopword_writer.unlock();
+    Py_END_ALLOW_THREADS
+
+    if (error != 0)
+    {
+        errno = error;
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, p_path_obj);
+        Py_DECREF(p_path_obj);
+        return NULL;
+    }
+    Py_DECREF(p_path_obj);
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyMethodDef StemMethods[] =
+{
+     {"stem", (PyCFunction)(void (*)(void))py_stem, METH_FASTCALL, "run a str (or ascii bytes) word through the Porter Stemmer."},
+     {"stem_many", (PyCFunction)(void (*)(void))py_stem_many, METH_VARARGS | METH_KEYWORDS, "run a sequence of str or bytes words through the Porter Stemmer, returning a list of stems. threads > 1 stems on that many native threads without the GIL (0: one per core)."},
+     {"stem_text", (PyCFunction)(void (*)(void))py_stem_text, METH_VARARGS | METH_KEYWORDS, "stem_text(text, join=False, plurals_only=0): split raw text into words, lower case them (ascii letters only) and stem them, returning a list of stems or, with join, one string of stems separated by spaces. Stopwords are kept unstemmed."},
+     {"stem_hashes", (PyCFunction)(void (*)(void))py_stem_hashes, METH_VARARGS | METH_KEYWORDS, "stem a sequence of str or bytes words and return a uint64 array holding a stable 64-bit hash of each stem, started from seed."},
+     {"bag_of_words", (PyCFunction)(void (*)(void))py_bag_of_words, METH_VARARGS | METH_KEYWORDS, "bag_of_words(documents, vocabulary=None, plurals_only=0): stem a sequence of tokenized documents, leaving out stopwords, and return (indptr, indices, counts, vocabulary), the stem counts per document as a CSR matrix over the vocabulary's ids."},
+     {"set_stopwords", py_set_stopwords, METH_VARARGS, "assign a sequence of words for which stemming will be ignored."},
+     {"add_stopwords", py_add_stopwords, METH_O, "add_stopwords(words): add words to the stopwords; returns how many were new."},
+     {"remove_stopwords", py_remove_stopwords, METH_O, "remove_stopwords(words): take words out of the stopwords; returns how many there were."},
+     {"load_stopwords", py_load_stopwords, METH_VARARGS, "load_stopwords(path): replace the stopwords with those in a UTF-8 text file, one per line, or in an image written by save_stopwords, which is mapped rather than read; returns how many there are."},
+     {"save_stopwords", py_save_stopwords, METH_VARARGS, "save_stopwords(path): write the stopwords to path as an image for load_stopwords."},
+     {"set_cache_size", py_set_cache_size, METH_VARARGS, "cache up to n recently stemmed words (rounded up to a power of two, 0 disables the cache)."},
+     {"cache_info", py_cache_info, METH_NOARGS, "return the hits, misses, evictions, maxsize and currsize of the stem cache."},
+     {"cache_clear", py_cache_clear, METH_NOARGS, "empty the stem cache and reset its counters."},
+     {NULL, NULL, 0, NULL}
+};
+
+/*  $KB: multi-phase init. The stopwords and the stem cache are process wide
+    and the cache holds on to objects, so the module can't be shared between
+    subinterpreters that each have their own objects. */
+
+/*  $KB: the C API other extensions reach through the PorterStemmer._C_API
+    capsule, see porter_stemmer_capi.h. The stem functions are the library's
+    own; the stopword checks may run on any thread, with or without the
+    GIL, so they take the read side of the stopword table's RCU. */
+
+template <typename CharT>
+static int capi_is_stopword(const CharT* word, size_t len)
+{
+    unsigned parity;
+    StopwordTable* p_table = stopword_read_lock(&parity);
+    int found = is_stopword(p_table, word, len);
+    stopword_read_unlock(parity);
+    return found;
+}
+
+static const PorterStemmer_CAPI g_capi =
+{
+    PORTER_STEMMER_CAPI_VERSION,
+    porter_stem8,
+    porter_stem16,
+    porter_stem32,
+    porter_reserve,
+    capi_is_stopword<unsigned char>,
+    capi_is_stopword<uint16_t>,
+    capi_is_stopword<uint32_t>,
+};
+
+static int stem_exec(PyObject* module)
+{
+    if (!(StemArrayType.tp_flags & Py_TPFLAGS_READY))
+    {
+        StemArrayType.tp_name = "PorterStemmer.StemArray";
+        StemArrayType.tp_basicsize = sizeof(stem_array);
+        StemArrayType.tp_dealloc = stem_array_dealloc;
+        StemArrayType.tp_as_sequence = &StemArraySequence;
+        StemArrayType.tp_as_buffer = &StemArrayBuffer;
+        StemArrayType.tp_flags = Py_TPFLAGS_DEFAULT;
+        StemArrayType.tp_doc = "read only array of per word results, see stem_hashes.";
+        if (PyType_Ready(&StemArrayType) < 0)
+            return -1;
+    }
+
+    if (!(VocabularyType.tp_flags & Py_TPFLAGS_READY))
+    {
+        VocabularyType.tp_name = "PorterStemmer.Vocabulary";
+        VocabularyType.tp_basicsize = sizeof(vocabulary_object);
+        VocabularyType.tp_dealloc = vocabulary_dealloc;
+        VocabularyType.tp_as_sequence = &VocabularySequence;
+        VocabularyType.tp_flags = Py_TPFLAGS_DEFAULT;
+        VocabularyType.tp_doc = "Vocabulary(): maps stems to dense int32 ids and counts their document frequency.";
+        VocabularyType.tp_methods = VocabularyMethods;
+        VocabularyType.tp_new = vocabulary_new;
+        if (PyType_Ready(&VocabularyType) < 0)
+            return -1;
+    }
+
+    Py_INCREF(&StemArrayType);
+    if (PyModule_AddObject(module, "StemArray", (PyObject*)&StemArrayType) < 0)
+    {
+        Py_DECREF(&StemArrayType);
+        return -1;
+    }
+    Py_INCREF(&VocabularyType);
+    if (PyModule_AddObject(module, "Vocabulary", (PyObject*)&VocabularyType) < 0)
+    {
+        Py_DECREF(&VocabularyType);
+        return -1;
+    }
+    PyObject* p_capsule = PyCapsule_New((void*)&g_capi, PORTER_STEMMER_CAPSULE_NAME, NULL);
+    if (p_capsule == NULL)
+        return -1;
+    if (PyModule_AddObject(module, "_C_API", p_capsule) < 0)
+    {
+        Py_DECREF(p_capsule);
+        return -1;
+    }
+    return 0;
+}
+
+static PyModuleDef_Slot StemSlots[] =
+{
+    {Py_mod_exec, (void*)stem_exec},
+#ifdef Py_mod_multiple_interpreters
+    {Py_mod_multiple_interpreters, Py_MOD_MULTIPLE_INTERPRETERS_NOT_SUPPORTED},
+#endif
+    {0, NULL}
+};
+
+static struct PyModuleDef StemModule =
+{
+    PyModuleDef_HEAD_INIT,
+    "PorterStemmer",
+    "Porter stemming algorithm",
+    0,
+    StemMethods,
+    StemSlots,
+    NULL,
+    NULL,
+    NULL
 };
 
 PyMODINIT_FUNC
-initPorterStemmer(void)
+PyInit_PorterStemmer(void)
 {
-    (void) Py_InitModule("PorterStemmer", StemMethods);
+    return PyModuleDef_Init(&StemModule);
 }
@@ -0,0 +1,114 @@
+/*
+    porter_stemmer.h - the Porter stemmer without Python.
+
+    $KB: this is the interface to the stemming kernel in
+    porter_stemmer_core.cpp, which `make` builds into libporterstemmer.a.
+    Nothing here needs Python; the PorterStemmer extension and the stem
+    command line tool are both written against it.
+
+    A word is a span of code units, a pointer and a length, stemmed in
+    place. Only lower case ascii letters take part in the rules: anything
+    else (upper case, digits, characters past ascii) counts as a consonant
+    and is never stripped, so lower case words before stemming them.
+    Stemming never lengthens a word; the stem is the first n code units of
+    the span, where n is the length returned.
+
+    Words of up to 64 letters are stemmed without allocating. A longer one
+    uses a scratch buffer kept per thread, which is the only thing that can
+    fail. All the functions are thread safe.
+*/
+
+#ifndef PORTER_STEMMER_H
+#define PORTER_STEMMER_H
+
+#include <stddef.h>  /* for size_t, ptrdiff_t */
+#include <stdint.h>  /* for uint16_t, uint32_t */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*  The C ABI. porter_stem8/16/32(word, len, plurals_only) stem word[0] ...
+    word[len-1] as 8, 16 or 32 bit code units, only taking off plurals if
+    plurals_only is non-zero, and return the stem's length; or -1, leaving
+    the word untouched, if there was no memory for a long word.
+    porter_reserve(len) makes room on the calling thread for the next word
+    of up to len code units, so stemming it can't fail; it returns 0, or -1
+    if there is no memory. */
+
+ptrdiff_t porter_stem8(unsigned char* word, size_t len, int plurals_only);
+ptrdiff_t porter_stem16(uint16_t* word, size_t len, int plurals_only);
+ptrdiff_t porter_stem32(uint32_t* word, size_t len, int plurals_only);
+int porter_reserve(size_t len);
+
+/*  porter_word_char(ch) is non-zero if the ascii code ch is a letter or a
+    digit. Words are runs of these for stem_text() and the stem tool alike;
+    past ascii, stem_text() asks Python whether a str character is a letter
+    or digit, while the tool, which has no decoder, takes every such byte. */
+
+static inline int porter_word_char(unsigned int ch)
+{
+    return (ch | 0x20) - 'a' < 26u || ch - '0' < 10u;
+}
+
+#ifdef __cplusplus
+}
+
+#if __cplusplus >= 201703L
+#include <string>
+#include <string_view>
+#endif
+
+namespace porter
+{
+
+/*  stem_in_place(word, len, plurals_only) stems word[0] ... word[len-1] and
+    returns the stem's length. It throws std::bad_alloc if there is no
+    memory for a long word, which is then left as it is. The unsigned
+    overloads take the same code units as raw integers, the way Python and
+    most C libraries store text. */
+
+size_t stem_in_place(char* word, size_t len, bool plurals_only = false);
+size_t stem_in_place(char16_t* word, size_t len, bool plurals_only = false);
+size_t stem_in_place(char32_t* word, size_t len, bool plurals_only = false);
+size_t stem_in_place(unsigned char* word, size_t len, bool plurals_only = false);
+size_t stem_in_place(uint16_t* word, size_t len, bool plurals_only = false);
+size_t stem_in_place(uint32_t* word, size_t len, bool plurals_only = false);
+
+/* reserve(len) is porter_reserve(), throwing std::bad_alloc on failure */
+void reserve(size_t len);
+
+#if __cplusplus >= 201703L
+
+/* stem(word, plurals_only) returns the stem of word as a new string */
+
+template <typename CharT>
+inline std::basic_string<CharT> stem_copy(std::basic_string_view<CharT> word, bool plurals_only)
+{
+    std::basic_string<CharT> result(word);
+    result.resize(stem_in_place(&result[0], result.size(), plurals_only));
+    return result;
+}
+
+inline std::string stem(std::string_view word, bool plurals_only = false)
+{
+    return stem_copy(word, plurals_only);
+}
+
+inline std::u16string stem(std::u16string_view word, bool plurals_only = false)
+{
+    return stem_copy(word, plurals_only);
+}
+
+inline std::u32string stem(std::u32string_view word, bool plurals_only = false)
+{
+    return stem_copy(word, plurals_only);
+}
+
+#endif
+
+} /* namespace porter */
+
+#endif /* __cplusplus */
+
+#endif /* PORTER_STEMMER_H */
@@ -0,0 +1,86 @@
+/*
+    porter_stemmer_capi.h - calling the PorterStemmer extension from C.
+
+    $KB: other extensions can stem raw buffers through the function table
+    the module exports as the capsule PorterStemmer._C_API, without going
+    through stem() and its argument tuples and str objects. Include this
+    header (it needs Python.h) and fetch the table once, e.g. in the
+    module's init:
+
+        static const PorterStemmer_CAPI* g_stemmer;
+        ...
+        g_stemmer = PorterStemmer_Import();
+        if (g_stemmer == NULL)
+            return NULL;
+        ...
+        if (!g_stemmer->is_stopword8(word, len))
+            len = g_stemmer->stem8(word, len, 0);
+
+    A word is a span of 8, 16 or 32-bit code units, the same widths as the
+    PEP 393 kinds of a str, so PyUnicode_DATA can be handed over as it is.
+    The stem functions stem the word in place and return the stem's length,
+    or -1, leaving the word untouched, if there was no memory for a word of
+    over 64 letters; reserve(len) makes room for one up front. They only
+    see lower case ascii letters as letters. Nothing in them touches Python,
+    so they can be called without holding the GIL.
+
+    The is_stopword functions are TRUE <=> the word is one of the stopwords
+    given to set_stopwords() or load_stopwords(), which stem() leaves
+    alone. They too can be called from any thread, GIL or not: those and
+    add_stopwords() and remove_stopwords() change the stopwords without
+    waiting on them or disturbing a lookup in progress.
+
+    The table only ever grows at the end; version says how much of it there
+    is. PorterStemmer_Import fails with an ImportError if the installed
+    module is older than this header.
+*/
+
+#ifndef PORTER_STEMMER_CAPI_H
+#define PORTER_STEMMER_CAPI_H
+
+#include <Python.h>
+#include <stddef.h>  /* for size_t, ptrdiff_t */
+#include <stdint.h>  /* for uint16_t, uint32_t */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PORTER_STEMMER_CAPSULE_NAME "PorterStemmer._C_API"
+#define PORTER_STEMMER_CAPI_VERSION 1
+
+typedef struct
+{
+    int version;    /* PORTER_STEMMER_CAPI_VERSION of the module */
+
+    /* version 1 */
+    ptrdiff_t (*stem8)(unsigned char* word, size_t len, int plurals_only);
+    ptrdiff_t (*stem16)(uint16_t* word, size_t len, int plurals_only);
+    ptrdiff_t (*stem32)(uint32_t* word, size_t len, int plurals_only);
+    int (*reserve)(size_t len);
+    int (*is_stopword8)(const unsigned char* word, size_t len);
+    int (*is_stopword16)(const uint16_t* word, size_t len);
+    int (*is_stopword32)(const uint32_t* word, size_t len);
+} PorterStemmer_CAPI;
+
+/* PorterStemmer_Import() imports the module and returns its table, or NULL
+   with a Python error set */
+
+static inline const PorterStemmer_CAPI* PorterStemmer_Import(void)
+{
+    const PorterStemmer_CAPI* p_api =
+        (const PorterStemmer_CAPI*)PyCapsule_Import(PORTER_STEMMER_CAPSULE_NAME, 0);
+    if (p_api != NULL && p_api->version < PORTER_STEMMER_CAPI_VERSION)
+    {
+        PyErr_Format(PyExc_ImportError, "PorterStemmer C API version %d is older than %d",
+                     p_api->version, PORTER_STEMMER_CAPI_VERSION);
+        return NULL;
+    }
+    return p_api;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PORTER_STEMMER_CAPI_H */
@@ -0,0 +1,974 @@
+/*
+    Original Comment:
+ 
+    This is the Porter stemming algorithm, coded up as thread-safe ANSI C
+    by the author.
+    
+    It may be be regarded as cononical, in that it follows the algorithm
+    presented in
+    
+    Porter, 1980, An algorithm for suffix stripping, Program, Vol. 14,
+    no. 3, pp 130-137,
+    
+    only differing from it at the points maked --DEPARTURE-- below.
+    
+    See also http://www.tartarus.org/~martin/PorterStemmer
+    
+    The algorithm as described in the paper could be exactly replicated
+    by adjusting the points of DEPARTURE, but this is barely necessary,
+    because (a) the points of DEPARTURE are definitely improvements, and
+    (b) no encoding of the Porter stemmer I have seen is anything like
+    as exact as this version, even with the points of DEPARTURE!
+    
+    You can compile it on Unix with 'gcc -O3 -o stem stem.c' after which
+    'stem' takes a list of inputs and sends the stemmed equivalent to
+    stdout.
+    
+    The algorithm as encoded here is particularly fast.
+    
+    Release 2 (the more old-fashioned, non-thread-safe version may be
+    regarded as release 1.)
+
+    --------------------------------------------------------------------
+    
+    $KB: This has been modified fairly heavily to work as a python extension.
+    
+    The functions have been updated to work with wide character types
+    instead of chars. This used to be Python 2's Py_UNICODE; since the port
+    to Python 3 a str is read in its PEP 393 storage, one, two or four bytes
+    per character (Py_UCS1, Py_UCS2, Py_UCS4), see
+    https://docs.python.org/3/c-api/unicode.html for more info.
+    
+    To be portable, all static strings needed to be generated as arrays of
+    wide characters. These used to be written out by hand (with the help of
+    helper/convert_strings.py), but are now built at compile time from
+    ordinary string literals:
+    
+    static constexpr suffix step4_al = make_suffix("al");
+
+    The stemming functions themselves are templates on the code unit type
+    (CharT), so the same code stems each str kind and bytes, all without
+    being widened first.
+
+    Since the split into a library this file is the kernel alone, with no
+    Python in it: porter_stemmer.h declares its interface, the extension's
+    binding is in porter_stemmer.cpp and the stand alone stemmer in
+    stem_cli.cpp. On Unix 'make' builds libporterstemmer.a and 'stem',
+    which reads text from its file arguments or stdin and sends it to
+    stdout with each word stemmed.
+
+*/
+
+
+#include "porter_stemmer.h"
+#include "porter_stemmer_internal.h"
+
+#include <string.h>  /* for memcmp, memset */
+#include <stdint.h>  /* for uint64_t */
+#include <vector>
+#include <new>      /* for std::bad_alloc */
+#include <limits.h> /* for INT_MAX */
+
+template <typename CharT> struct stemmer;
+
+template <typename CharT> int stem(stemmer<CharT> * z, CharT * b, int b_len, int plurals_only);
+
+
+/* The main part of the stemming algorithm starts here.
+*/
+
+/* stemmer is a structure for a few local bits of data,
+*/
+
+/* words up to this long keep their consonant pattern in a single uint64_t */
+#define STEMMER_MASK_BITS 64
+
+template <typename CharT>
+struct stemmer {
+    CharT * b;         /* buffer for word to be stemmed */
+    int k;          /* offset to the end of the string */
+    int j;          /* a general offset into the string */
+    uint64_t cmask;    /* bit i is set <=> b[i] is a consonant, for short words */
+    uint64_t tail;     /* b[k-7] ... b[k] one per byte, see pack_tail() */
+    int tail_k;        /* the k tail was packed for, -1 if stale */
+    unsigned char * c; /* c[i] is TRUE <=> b[i] is a consonant, for long words;
+                          NULL when cmask is in use */
+};
+
+
+/*  Member b is a buffer holding a word to be stemmed. The letters are in
+    b[0], b[1] ... ending at b[z->k]. Member k is readjusted downwards as
+    the stemming progresses. Zero termination is not in fact used in the
+    algorithm.
+
+    Note that only lower case sequences are stemmed. Forcing to lower case
+    should be done before stem(...) is called.
+
+
+    Typical usage is:
+
+        stemmer<char32_t> z;
+        char32_t b[] = U"pencils";
+        int res = stem(&z, b, 7, 0);
+            /- stem the 7 characters of b[0] to b[6]. The result, res,
+               is the new length, 6 (the 's' is removed). -/
+*/
+
+
+/* lowmask(j) has bits 0 ... j set, for -1 <= j < STEMMER_MASK_BITS */
+
+static inline uint64_t lowmask(int j)
+{
+    return (j >= STEMMER_MASK_BITS - 1) ? ~(uint64_t)0 : (((uint64_t)1 << (j + 1)) - 1);
+}
+
+static inline int popcount64(uint64_t x)
+{
+#if defined(__GNUC__)
+    return __builtin_popcountll(x);
+#else
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (int)((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+/*  cons(z, i) is TRUE <=> b[i] is a consonant. ('b' means 'z->b', but here
+    and below we drop 'z->' in comments.)
+*/
+
+template <typename CharT>
+static inline int cons(stemmer<CharT> * z, int i)
+{
+    if (z->c == NULL) return (int)((z->cmask >> i) & 1);
+    return z->c[i];
+}
+
+/*  classify(z, i) records whether each of b[i] ... b[k] is a consonant, in
+    cmask for words of up to STEMMER_MASK_BITS letters and in c otherwise.
+    A 'y' is a consonant unless it follows one, so each letter only depends
+    on the one before it and a single forward pass will do.
+    $KB: the original recursed back through every 'y' each time a letter was
+    tested, which made runs of 'y' quadratic. Now the word is classified
+    once in stem() and again from j+1 whenever setto() rewrites the end.
+*/
+
+static inline int classify_letter(uint32_t ch, int prev_cons)
+{
+    switch (ch)
+    {
+        case 'a': case 'e': case 'i': case 'o': case 'u': return FALSE;
+        case 'y': return !prev_cons;
+        default: return TRUE;
+    }
+}
+
+template <typename CharT>
+static void classify(stemmer<CharT> * z, int i)
+{
+    CharT * b = z->b;
+    int prev_cons = (i == 0) ? FALSE : cons(z, i - 1); /* a leading 'y' is a consonant */
+    if (z->c == NULL)
+    {
+        uint64_t cmask = z->cmask & lowmask(i - 1);
+        for (; i <= z->k; i++)
+        {
+            prev_cons = classify_letter(b[i], prev_cons);
+            cmask |= (uint64_t)prev_cons << i;
+        }
+        z->cmask = cmask;
+    }
+    else
+    {
+        for (; i <= z->k; i++)
+            z->c[i] = (unsigned char)(prev_cons = classify_letter(b[i], prev_cons));
+    }
+}
+
+/*  m(z) measures the number of consonant sequences between 0 and j. if c is
+    a consonant sequence and v a vowel sequence, and <..> indicates arbitrary
+    presence,
+
+        <c><v>       gives 0
+        <c>vc<v>     gives 1
+        <c>vcvc<v>   gives 2
+        <c>vcvcvc<v> gives 3
+        ....
+*/
+
+template <typename CharT>
+static int m(stemmer<CharT> * z)
+{  
+    /* $KB: each vc pair is a consonant whose predecessor is a vowel, so with
+       the pattern in a bitmask the measure is just a popcount of those
+       transitions within 0 ... j. */
+    if (z->c == NULL)
+    {
+        uint64_t range = lowmask(z->j);
+        uint64_t c = z->cmask & range;
+        uint64_t v = ~z->cmask & range;
+        return popcount64(c & (v << 1));
+    }
+
+    int n = 0;
+    int i = 0;
+    int j = z->j;
+    while(TRUE)
+    {
+        if (i > j) return n;
+        if (! cons(z, i)) break;
+        i++;
+    }
+    i++;
+    while(TRUE)
+    {  
+        while(TRUE)
+        {  
+            if (i > j) return n;
+            if (cons(z, i)) break;
+            i++;
+        }
+        i++;
+        n++;
+        while(TRUE)
+        {
+            if (i > j) return n;
+            if (! cons(z, i)) break;
+            i++;
+        }
+        i++;
+    }
+}
+
+/* vowelinstem(z) is TRUE <=> 0,...j contains a vowel */
+
+template <typename CharT>
+static int vowelinstem(stemmer<CharT> * z)
+{
+    if (z->c == NULL) return (~z->cmask & lowmask(z->j)) != 0;
+    int j = z->j;
+    int i; for (i = 0; i <= j; i++) if (! cons(z, i)) return TRUE;
+    return FALSE;
+}
+
+/* doublec(z, j) is TRUE <=> j,(j-1) contain a double consonant. */
+
+template <typename CharT>
+static int doublec(stemmer<CharT> * z, int j)
+{
+    CharT * b = z->b;
+    if (j < 1) return FALSE;
+    if (b[j] != b[j - 1]) return FALSE;
+    return cons(z, j);
+}
+
+/*  cvc(z, i) is TRUE <=> i-2,i-1,i has the form consonant - vowel - consonant
+    and also if the second c is not w,x or y. this is used when trying to
+    restore an e at the end of a short word. e.g.
+
+        cav(e), lov(e), hop(e), crim(e), but
+        snow, box, tray.
+
+*/
+
+template <typename CharT>
+static int cvc(stemmer<CharT> * z, int i)
+{  
+    if (i < 2 || !cons(z, i) || cons(z, i - 1) || !cons(z, i - 2)) return FALSE;
+    {
+        int ch = z->b[i];
+        if (ch  == 'w' || ch == 'x' || ch == 'y') return FALSE;
+    }
+    return TRUE;
+}
+
+/*  $KB: a suffix is a short lower case ascii string. Along with its letters
+    it carries a packed form, one letter per byte with the last letter in
+    the high byte (so it lines up with the word's last eight letters loaded
+    in memory order), and a mask of the bytes in use. All of it is computed at
+    compile time by make_suffix() from a plain string literal, e.g.
+
+        static constexpr suffix step1a_sses = make_suffix("sses");
+*/
+
+#define SUFFIX_MAX 8  /* letters that fit in a uint64_t, one per byte */
+
+struct suffix
+{
+    int length;
+    char chars[SUFFIX_MAX];
+    uint64_t packed;
+    uint64_t mask;
+};
+
+template <size_t N>
+constexpr suffix make_suffix(const char (&s)[N])
+{
+    static_assert(N - 1 <= SUFFIX_MAX, "suffix too long to pack into a uint64_t");
+    suffix result = {};
+    result.length = (int)(N - 1);
+    for (size_t i = 0; i < N - 1; i++)
+    {
+        int shift = (int)(8 * (SUFFIX_MAX - (N - 1) + i));
+        result.chars[i] = s[i];
+        result.packed |= (uint64_t)(unsigned char)s[i] << shift;
+        result.mask |= (uint64_t)0xff << shift;
+    }
+    return result;
+}
+
+/*  pack_tail(z) returns b[k-7] ... b[k] packed like a suffix, b[k] in the
+    high byte and zeros before b[0]. A letter beyond 0xff is saturated so it
+    can never alias an ascii letter. The result is kept until k moves or
+    setto() rewrites the word.
+
+    Once the word has eight letters they are narrowed in one go with SSE2 or
+    NEON saturating packs, which is where the byte order comes from; 8-bit
+    strings need no narrowing at all. For 16-bit code units the SSE2 pack is
+    signed, so letters from 0x8000 up become 0 rather than 0xff, which is
+    just as unable to match.
+*/
+
+static inline uint64_t saturate8(uint32_t ch) { return ch < 0xff ? ch : 0xff; }
+
+template <typename CharT>
+static inline uint64_t pack_tail8(const CharT * p)
+{
+#if defined(STEMMER_SSE2) || defined(STEMMER_NEON)
+    /* both are little endian here, so memory order is the packed order */
+    if (sizeof(CharT) == 1)
+    {
+        uint64_t tail;
+        memcpy(&tail, p, sizeof(tail));
+        return tail;
+    }
+#endif
+#if defined(STEMMER_SSE2)
+    __m128i wide;
+    if (sizeof(CharT) == 4)
+        wide = _mm_packs_epi32(_mm_loadu_si128((const __m128i *)p), _mm_loadu_si128((const __m128i *)(p + 4)));
+    else
+        wide = _mm_loadu_si128((const __m128i *)p);
+    uint64_t tail;
+    _mm_storel_epi64((__m128i *)&tail, _mm_packus_epi16(wide, wide));
+    return tail;
+#elif defined(STEMMER_NEON)
+    uint16x8_t wide;
+    if (sizeof(CharT) == 4)
+        wide = vcombine_u16(vqmovn_u32(vld1q_u32((const uint32_t *)p)),
+                            vqmovn_u32(vld1q_u32((const uint32_t *)p + 4)));
+    else
+        wide = vld1q_u16((const uint16_t *)p);
+    return vget_lane_u64(vreinterpret_u64_u8(vqmovn_u16(wide)), 0);
+#else
+    uint64_t tail = 0;
+    for (int i = 0; i < SUFFIX_MAX; i++)
+        tail |= saturate8(p[i]) << (8 * i);
+    return tail;
+#endif
+}
+
+template <typename CharT>
+static inline uint64_t pack_tail(stemmer<CharT> * z)
+{
+    if (z->tail_k != z->k)
+    {
+        const CharT * b = z->b;
+        int k = z->k;
+        uint64_t tail = 0;
+        if (k + 1 >= SUFFIX_MAX)
+            tail = pack_tail8(b + k - (SUFFIX_MAX - 1));
+        else
+            for (int i = 0; i <= k; i++)
+                tail |= saturate8(b[k - i]) << (8 * (SUFFIX_MAX - 1 - i));
+        z->tail = tail;
+        z->tail_k = k;
+    }
+    return z->tail;
+}
+
+/* ends(z, s) is TRUE <=> 0,...k ends with the string s. */
+
+template <typename CharT>
+static int ends(stemmer<CharT> * z, const suffix & s)
+{  
+    if (s.length > z->k + 1) return FALSE;
+    if ((uint64_t)z->b[z->k] != (s.packed >> 56)) return FALSE; /* tiny speed-up */
+    if ((pack_tail(z) & s.mask) != s.packed) return FALSE;
+    z->j = z->k - s.length;
+    return TRUE;
+}
+
+/* setto(z, s) sets (j+1),...k to the characters in the string s, readjusting
+    k. */
+
+template <typename CharT>
+static void setto(stemmer<CharT> * z, const suffix & s)
+{  
+    int j = z->j;
+    for (int i = 0; i < s.length; i++) z->b[j + 1 + i] = (CharT)s.chars[i];
+    z->k = j + s.length;
+    z->tail_k = -1;
+    classify(z, j + 1);
+}
+
+/* r(z, s) is used further down. It returns TRUE if the word was changed. */
+
+template <typename CharT>
+static int r(stemmer<CharT> * z, const suffix & s) { if (m(z) > 0) { setto(z, s); return TRUE; } return FALSE; }
+
+/*  $KB: splitting step1ab into two functions--one to deal with pluralization,
+    the other for the rest. This is a stop-gap measure before handling word
+    forms in a generic way. */
+
+/* step1a(z) gets rid of plurals e.g.
+
+        caresses  ->  caress
+        ponies    ->  poni
+        ties      ->  ti
+        caress    ->  caress
+        cats      ->  cat
+        meetings  ->  meeting
+*/
+
+
+static constexpr suffix step1a_sses = make_suffix("sses");
+static constexpr suffix step1a_ies = make_suffix("ies");
+static constexpr suffix step1a_i = make_suffix("i");
+
+template <typename CharT>
+static void step1a(stemmer<CharT> * z)
+{
+    CharT * b = z->b;
+    if (b[z->k] == 's')
+    {
+        if (ends(z, step1a_sses)) z->k -= 2; else
+        if (ends(z, step1a_ies)) setto(z, step1a_i); else
+        if (b[z->k - 1] != 's') z->k--;
+    }
+}
+
+/* step1b(z) gets rid of -ed or -ing. e.g.
+
+        feed      ->  feed
+        agreed    ->  agree
+        disabled  ->  disable
+
+        matting   ->  mat
+        mating    ->  mate
+        meeting   ->  meet
+        milling   ->  mill
+        messing   ->  mess
+*/
+
+static constexpr suffix step1b_eed = make_suffix("eed");
+static constexpr suffix step1b_ed = make_suffix("ed");
+static constexpr suffix step1b_ing = make_suffix("ing");
+static constexpr suffix step1b_at = make_suffix("at");
+static constexpr suffix step1b_ate = make_suffix("ate");
+static constexpr suffix step1b_bl = make_suffix("bl");
+static constexpr suffix step1b_ble = make_suffix("ble");
+static constexpr suffix step1b_iz = make_suffix("iz");
+static constexpr suffix step1b_ize = make_suffix("ize");
+static constexpr suffix step1b_e = make_suffix("e");
+
+template <typename CharT>
+static void step1b(stemmer<CharT> * z)
+{
+    CharT * b = z->b;
+    if (ends(z, step1b_eed)) { if (m(z) > 0) z->k--; } else
+    if ((ends(z, step1b_ed) || ends(z, step1b_ing)) && vowelinstem(z))
+    {
+        z->k = z->j;
+        if (ends(z, step1b_at)) setto(z, step1b_ate); else
+        if (ends(z, step1b_bl)) setto(z, step1b_ble); else
+        if (ends(z, step1b_iz)) setto(z, step1b_ize); else
+        if (doublec(z, z->k))
+        {
+            z->k--;
+            {
+                int ch = b[z->k];
+                if (ch == 'l' || ch == 's' || ch == 'z') z->k++;
+            }
+        }
+        else if (m(z) == 1 && cvc(z, z->k)) setto(z, step1b_e);
+    }
+}
+
+/* step1c(z) turns terminal y to i when there is another vowel in the stem. */
+
+static constexpr suffix step1c_y = make_suffix("y");
+
+template <typename CharT>
+static void step1c(stemmer<CharT> * z)
+{
+    if (ends(z, step1c_y) && vowelinstem(z)) { z->b[z->k] = 'i'; z->tail_k = -1; classify(z, z->k); }
+}
+
+/*  $KB: steps 2, 3 and 4 each strip one suffix from a fixed list. Rather
+    than trying the candidates one ends() call at a time, the three lists are
+    compiled into a single automaton over the reversed suffixes (see
+    match_suffixes() below), and one backwards walk from b[k] finds, for each
+    step, the longest listed suffix that the word ends with. No list holds a
+    suffix ahead of a longer one ending with it, so the longest match is the
+    rule the original chains of ends() calls picked. The walk is repeated
+    only when a step actually rewrites the end of the word; otherwise the
+    later steps reuse its result.
+*/
+
+struct suffix_rule
+{
+    const suffix * ending;
+    const suffix * replacement;  /* NULL in step4, which only strips */
+};
+
+enum { STEP2, STEP3, STEP4, NUM_SUFFIX_STEPS };
+
+struct suffix_match
+{
+    int rule[NUM_SUFFIX_STEPS];  /* index into each step's rules, or -1 */
+};
+
+/*  apply_rule(z, rules, idx) points j at the start of the matched suffix and
+    replaces it when m(z) > 0. Returns TRUE if the word was changed. */
+
+template <typename CharT>
+static int apply_rule(stemmer<CharT> * z, const suffix_rule * rules, int idx)
+{
+    if (idx < 0) return FALSE;
+    z->j = z->k - rules[idx].ending->length;
+    return r(z, *rules[idx].replacement);
+}
+
+
+/*  step2(z) maps double suffices to single ones. so -ization ( = -ize plus
+    -ation) maps to -ize etc. note that the string before the suffix must give
+    m(z) > 0. */
+
+static constexpr suffix step2_ational = make_suffix("ational");
+static constexpr suffix step2_ate = make_suffix("ate");
+static constexpr suffix step2_tional = make_suffix("tional");
+static constexpr suffix step2_tion = make_suffix("tion");
+static constexpr suffix step2_enci = make_suffix("enci");
+static constexpr suffix step2_ence = make_suffix("ence");
+static constexpr suffix step2_anci = make_suffix("anci");
+static constexpr suffix step2_ance = make_suffix("ance");
+static constexpr suffix step2_izer = make_suffix("izer");
+static constexpr suffix step2_ize = make_suffix("ize");
+static constexpr suffix step2_bli = make_suffix("bli");
+static constexpr suffix step2_ble = make_suffix("ble");
+static constexpr suffix step2_abli = make_suffix("abli");
+static constexpr suffix step2_able = make_suffix("able");
+static constexpr suffix step2_alli = make_suffix("alli");
+static constexpr suffix step2_al = make_suffix("al");
+static constexpr suffix step2_entli = make_suffix("entli");
+static constexpr suffix step2_ent = make_suffix("ent");
+static constexpr suffix step2_eli = make_suffix("eli");
+static constexpr suffix step2_e = make_suffix("e");
+static constexpr suffix step2_ousli = make_suffix("ousli");
+static constexpr suffix step2_ous = make_suffix("ous");
+static constexpr suffix step2_ization = make_suffix("ization");
+static constexpr suffix step2_ation = make_suffix("ation");
+static constexpr suffix step2_ator = make_suffix("ator");
+static constexpr suffix step2_alism = make_suffix("alism");
+static constexpr suffix step2_iveness = make_suffix("iveness");
+static constexpr suffix step2_ive = make_suffix("ive");
+static constexpr suffix step2_fulness = make_suffix("fulness");
+static constexpr suffix step2_ful = make_suffix("ful");
+static constexpr suffix step2_ousness = make_suffix("ousness");
+static constexpr suffix step2_aliti = make_suffix("aliti");
+static constexpr suffix step2_iviti = make_suffix("iviti");
+static constexpr suffix step2_biliti = make_suffix("biliti");
+static constexpr suffix step2_logi = make_suffix("logi");
+static constexpr suffix step2_log = make_suffix("log");
+
+static constexpr suffix_rule step2_rules[] =
+{
+    { &step2_ational, &step2_ate },
+    { &step2_tional, &step2_tion },
+    { &step2_enci, &step2_ence },
+    { &step2_anci, &step2_ance },
+    { &step2_izer, &step2_ize },
+    { &step2_bli, &step2_ble }, /*-DEPARTURE-*/
+
+ /* To match the published algorithm, replace this line with
+    { &step2_abli, &step2_able }, */
+
+    { &step2_alli, &step2_al },
+    { &step2_entli, &step2_ent },
+    { &step2_eli, &step2_e },
+    { &step2_ousli, &step2_ous },
+    { &step2_ization, &step2_ize },
+    { &step2_ation, &step2_ate },
+    { &step2_ator, &step2_ate },
+    { &step2_alism, &step2_al },
+    { &step2_iveness, &step2_ive },
+    { &step2_fulness, &step2_ful },
+    { &step2_ousness, &step2_ous },
+    { &step2_aliti, &step2_al },
+    { &step2_iviti, &step2_ive },
+    { &step2_biliti, &step2_ble },
+    { &step2_logi, &step2_log }, /*-DEPARTURE-*/
+};
+
+template <typename CharT>
+static int step2(stemmer<CharT> * z, const suffix_match * p_match)
+{ 
+    return apply_rule(z, step2_rules, p_match->rule[STEP2]);
+}
+
+/* step3(z) deals with -ic-, -full, -ness etc. similar strategy to step2. */
+
+static constexpr suffix step3_icate = make_suffix("icate");
+static constexpr suffix step3_ic = make_suffix("ic");
+static constexpr suffix step3_ative = make_suffix("ative");
+static constexpr suffix step3_null = make_suffix("");
+static constexpr suffix step3_alize = make_suffix("alize");
+static constexpr suffix step3_al = make_suffix("al");
+static constexpr suffix step3_iciti = make_suffix("iciti");
+static constexpr suffix step3_ical = make_suffix("ical");
+static constexpr suffix step3_ful = make_suffix("ful");
+static constexpr suffix step3_ness = make_suffix("ness");
+
+static constexpr suffix_rule step3_rules[] =
+{
+    { &step3_icate, &step3_ic },
+    { &step3_ative, &step3_null },
+    { &step3_alize, &step3_al },
+    { &step3_iciti, &step3_ic },
+    { &step3_ical, &step3_ic },
+    { &step3_ful, &step3_null },
+    { &step3_ness, &step3_null },
+};
+
+template <typename CharT>
+static int step3(stemmer<CharT> * z, const suffix_match * p_match)
+{ 
+    return apply_rule(z, step3_rules, p_match->rule[STEP3]);
+}
+
+/* step4(z) takes off -ant, -ence etc., in context <c>vcvc<v>. */
+
+static constexpr suffix step4_al = make_suffix("al");
+static constexpr suffix step4_ance = make_suffix("ance");
+static constexpr suffix step4_ence = make_suffix("ence");
+static constexpr suffix step4_er = make_suffix("er");
+static constexpr suffix step4_ic = make_suffix("ic");
+static constexpr suffix step4_able = make_suffix("able");
+static constexpr suffix step4_ible = make_suffix("ible");
+static constexpr suffix step4_ant = make_suffix("ant");
+static constexpr suffix step4_ement = make_suffix("ement");
+static constexpr suffix step4_ment = make_suffix("ment");
+static constexpr suffix step4_ent = make_suffix("ent");
+static constexpr suffix step4_ion = make_suffix("ion");
+static constexpr suffix step4_ou = make_suffix("ou");
+static constexpr suffix step4_ism = make_suffix("ism");
+static constexpr suffix step4_ate = make_suffix("ate");
+static constexpr suffix step4_iti = make_suffix("iti");
+static constexpr suffix step4_ous = make_suffix("ous");
+static constexpr suffix step4_ive = make_suffix("ive");
+static constexpr suffix step4_ize = make_suffix("ize");
+
+static constexpr suffix_rule step4_rules[] =
+{
+    { &step4_al, NULL },
+    { &step4_ance, NULL },
+    { &step4_ence, NULL },
+    { &step4_er, NULL },
+    { &step4_ic, NULL },
+    { &step4_able, NULL },
+    { &step4_ible, NULL },
+    { &step4_ant, NULL },
+    { &step4_ement, NULL },
+    { &step4_ment, NULL },
+    { &step4_ent, NULL },
+    { &step4_ion, NULL },  /* only after s or t */
+    { &step4_ou, NULL },   /* takes care of -ous */
+    { &step4_ism, NULL },
+    { &step4_ate, NULL },
+    { &step4_iti, NULL },
+    { &step4_ous, NULL },
+    { &step4_ive, NULL },
+    { &step4_ize, NULL },
+};
+
+template <typename CharT>
+static void step4(stemmer<CharT> * z, const suffix_match * p_match)
+{
+    int idx = p_match->rule[STEP4];
+    if (idx < 0) return;
+    z->j = z->k - step4_rules[idx].ending->length;
+    if (step4_rules[idx].ending == &step4_ion && (z->j < 0 || (z->b[z->j] != 's' && z->b[z->j] != 't'))) return;
+    if (m(z) > 1) z->k = z->j;
+}
+
+/*  The suffix automaton is a trie of the step 2, 3 and 4 suffixes read
+    backwards. Each node records, per step, the rule whose suffix ends
+    there. Every suffix is lower case ascii, so a node just has a child
+    slot per letter; node 0 is the root and so never anyone's child, which
+    lets 0 stand for "no child".
+
+    It is built by constexpr code at compile time, not by a static
+    initializer: the library's callers include other translation units'
+    static constructors, which could otherwise run before it and stem
+    against an empty trie.
+*/
+
+#define SUFFIX_MAX_NODES 256 /* node ids fit an unsigned char; the rules need about 110 */
+
+struct suffix_node
+{
+    unsigned char next[26];             /* child for 'a' ... 'z', 0 for none */
+    signed char rule[NUM_SUFFIX_STEPS]; /* rule ending at this node, or -1 */
+    unsigned char accepts;              /* TRUE if any rule ends here */
+};
+
+struct suffix_automaton
+{
+    suffix_node nodes[SUFFIX_MAX_NODES];
+    int num_nodes;
+};
+
+static constexpr void add_suffix_rules(suffix_automaton * p_auto, int step, const suffix_rule * rules, int num_rules)
+{
+    for (int idx = 0; idx < num_rules; idx++)
+    {
+        const suffix * s = rules[idx].ending;
+        int node = 0;
+        for (int i = s->length - 1; i >= 0; i--)
+        {
+            int ch = s->chars[i] - 'a';
+            if (p_auto->nodes[node].next[ch] == 0)
+                p_auto->nodes[node].next[ch] = (unsigned char)p_auto->num_nodes++;
+            node = p_auto->nodes[node].next[ch];
+        }
+        if (p_auto->nodes[node].rule[step] < 0) p_auto->nodes[node].rule[step] = (signed char)idx;
+        p_auto->nodes[node].accepts = TRUE;
+    }
+}
+
+#define NUM_RULES(rules) ((int)(sizeof(rules) / sizeof(rules[0])))
+
+static constexpr suffix_automaton build_suffix_automaton()
+{
+    suffix_automaton automaton = {};    /* no children, nothing accepted */
+    for (int node = 0; node < SUFFIX_MAX_NODES; node++)
+        for (int step = 0; step < NUM_SUFFIX_STEPS; step++)
+            automaton.nodes[node].rule[step] = -1;
+    automaton.num_nodes = 1;
+    add_suffix_rules(&automaton, STEP2, step2_rules, NUM_RULES(step2_rules));
+    add_suffix_rules(&automaton, STEP3, step3_rules, NUM_RULES(step3_rules));
+    add_suffix_rules(&automaton, STEP4, step4_rules, NUM_RULES(step4_rules));
+    return automaton;
+}
+
+static constexpr suffix_automaton g_suffix_automaton = build_suffix_automaton();
+
+/*  match_suffixes(z, p_match) walks b[k], b[k-1] ... through the automaton,
+    leaving in p_match the longest matching rule of each step.
+*/
+
+template <typename CharT>
+static void match_suffixes(stemmer<CharT> * z, suffix_match * p_match)
+{
+    const suffix_node * nodes = g_suffix_automaton.nodes;
+
+    for (int step = 0; step < NUM_SUFFIX_STEPS; step++) p_match->rule[step] = -1;
+
+    int node = 0;
+    for (int i = z->k; i >= 0; i--)
+    {
+        unsigned int ch = (unsigned int)z->b[i] - 'a';
+        if (ch >= 26) break;
+        node = nodes[node].next[ch];
+        if (node == 0) break;
+        if (nodes[node].accepts)
+            for (int step = 0; step < NUM_SUFFIX_STEPS; step++)
+                if (nodes[node].rule[step] >= 0) p_match->rule[step] = nodes[node].rule[step];
+    }
+}
+
+/* step5(z) removes a final -e if m(z) > 1, and changes -ll to -l if
+    m(z) > 1. */
+
+template <typename CharT>
+static void step5(stemmer<CharT> * z)
+{
+    CharT * b = z->b;
+    z->j = z->k;
+    if (b[z->k] == 'e')
+    {
+        int a = m(z);
+        if (((a > 1) || (a == 1)) && !cvc(z, z->k - 1)) z->k--;
+    }
+    if (b[z->k] == 'l' && doublec(z, z->k) && m(z) > 1) z->k--;
+}
+
+/*  $KB: the consonant flags of a long word go in a scratch buffer. Each
+    thread keeps one and reuses it for the next long word, so a word only
+    allocates when it is longer than any seen on that thread before. A buffer
+    that has grown past STEM_SCRATCH_KEEP flags is given back after use
+    rather than pinning the memory of one huge token for good. */
+
+static std::vector<unsigned char>& cons_scratch()
+{
+    static thread_local std::vector<unsigned char> t_cons;
+    return t_cons;
+}
+
+/* cons_buffer(len) is a buffer for len flags; may throw bad_alloc */
+
+static unsigned char* cons_buffer(size_t len)
+{
+    std::vector<unsigned char>& buffer = cons_scratch();
+    if (buffer.size() < len)
+        buffer.resize(len);
+    return buffer.data();
+}
+
+static void cons_trim()
+{
+    std::vector<unsigned char>& buffer = cons_scratch();
+    if (buffer.size() > STEM_SCRATCH_KEEP)
+        std::vector<unsigned char>().swap(buffer);
+}
+
+/* In stem(z, b, k), b is a CharT pointer, and the string to be stemmed is
+    from b[0] to b[k] inclusive.  Possibly b[k+1] == '\0', but it is not
+    important. The stemmer adjusts the characters b[0] ... b[k] and returns
+    the new end-point of the string, k'. Stemming never increases word
+    length, so 0 <= k' <= k.
+
+    $KB: the time taken is linear in the word length. Each step scans the
+    word a bounded number of times, and a rewritten suffix is reclassified
+    from where it starts.
+*/
+// $KB: updated to take and return string length instead of a zero-based offset
+template <typename CharT>
+int stem(stemmer<CharT> * z, CharT * b, int b_len, int plurals_only)
+{
+    if (b_len <= 2) return b_len; /*-DEPARTURE-*/
+    z->b = b; z->k = (b_len-1); /* copy the parameters into z */
+
+    /* With this line, strings of length 1 or 2 don't go through the
+      stemming process, although no mention is made of this in the
+      published algorithm. Remove the line to match the published
+      algorithm. */
+
+    z->cmask = 0;
+    z->tail_k = -1;
+    z->c = (b_len <= STEMMER_MASK_BITS) ? NULL : cons_buffer(b_len);
+    classify(z, 0);
+
+    step1a(z);
+    if (plurals_only)
+    {
+        step5(z); // remove the trailing e
+    }
+    else
+    {
+        suffix_match match;
+        step1b(z); step1c(z);
+        match_suffixes(z, &match);
+        if (step2(z, &match)) match_suffixes(z, &match);
+        if (step3(z, &match)) match_suffixes(z, &match);
+        step4(z, &match); step5(z);
+    }
+    if (z->c != NULL)
+        cons_trim();
+    return z->k + 1;
+}
+
+/*  $KB: the library interface, see porter_stemmer.h. The kernel takes an
+    int length, so a word longer than INT_MAX code units is left as it is.
+    8-bit text is stemmed as unsigned char whatever the signedness of char,
+    so bytes past ascii read as large values, never as letters. */
+
+template <typename CharT>
+static size_t stem_span(CharT* word, size_t len, bool plurals_only)
+{
+    if (len > INT_MAX)
+        return len;
+    stemmer<CharT> z;
+    return (size_t)stem(&z, word, (int)len, plurals_only);
+}
+
+size_t porter::stem_in_place(char* word, size_t len, bool plurals_only)
+{
+    return stem_span((unsigned char*)word, len, plurals_only);
+}
+
+size_t porter::stem_in_place(char16_t* word, size_t len, bool plurals_only)
+{
+    return stem_span(word, len, plurals_only);
+}
+
+size_t porter::stem_in_place(char32_t* word, size_t len, bool plurals_only)
+{
+    return stem_span(word, len, plurals_only);
+}
+
+size_t porter::stem_in_place(unsigned char* word, size_t len, bool plurals_only)
+{
+    return stem_span(word, len, plurals_only);
+}
+
+size_t porter::stem_in_place(uint16_t* word, size_t len, bool plurals_only)
+{
+    return stem_span(word, len, plurals_only);
+}
+
+size_t porter::stem_in_place(uint32_t* word, size_t len, bool plurals_only)
+{
+    return stem_span(word, len, plurals_only);
+}
+
+void porter::reserve(size_t len)
+{
+    if (len > STEMMER_MASK_BITS)
+        cons_buffer(len);
+}
+
+/* no exception gets past the C ABI */
+
+template <typename CharT>
+static ptrdiff_t stem_c(CharT* word, size_t len, int plurals_only)
+{
+    try
+    {
+        return (ptrdiff_t)stem_span(word, len, plurals_only != 0);
+    }
+    catch (const std::bad_alloc&)
+    {
+        return -1;
+    }
+}
+
+extern "C" ptrdiff_t porter_stem8(unsigned char* word, size_t len, int plurals_only)
+{
+    return stem_c(word, len, plurals_only);
+}
+
+extern "C" ptrdiff_t porter_stem16(uint16_t* word, size_t len, int plurals_only)
+{
+    return stem_c(word, len, plurals_only);
+}
+
+extern "C" ptrdiff_t porter_stem32(uint32_t* word, size_t len, int plurals_only)
+{
+    return stem_c(word, len, plurals_only);
+}
+
+extern "C" int porter_reserve(size_t len)
+{
+    try
+    {
+        porter::reserve(len);
+        return 0;
+    }
+    catch (const std::bad_alloc&)
+    {
+        return -1;
+    }
+}
@@ -0,0 +1,32 @@
+/*
+    porter_stemmer_internal.h - what the kernel and the binding share.
+
+    $KB: porter_stemmer_core.cpp and porter_stemmer.cpp both vectorise and
+    both keep per thread scratch buffers, so the SIMD detection and the
+    scratch limit live here, where they can't drift apart. This header is
+    not installed; other code should use porter_stemmer.h.
+*/
+
+#ifndef PORTER_STEMMER_INTERNAL_H
+#define PORTER_STEMMER_INTERNAL_H
+
+/*  STEMMER_SSE2 or STEMMER_NEON is defined, with its intrinsics included,
+    when the target has it; big endian NEON is left to the scalar code. */
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define STEMMER_SSE2 1
+#elif defined(__ARM_NEON) && defined(__ARM_BIG_ENDIAN) == 0
+#include <arm_neon.h>
+#define STEMMER_NEON 1
+#endif
+
+#define TRUE 1
+#define FALSE 0
+
+/*  A per thread scratch buffer that has grown past this many items is given
+    back after use rather than pinning the memory of one huge token. */
+
+#define STEM_SCRATCH_KEEP 65536
+
+#endif /* PORTER_STEMMER_INTERNAL_H */
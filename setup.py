@@ -1,11 +1,19 @@
 #!/usr/bin/env python
 
-from distutils.core import setup, Extension
+try:
+    from setuptools import setup, Extension
+except ImportError:
+    from distutils.core import setup, Extension
 
-module1 = Extension('PorterStemmer', sources = ['porter_stemmer.cpp'])
+module1 = Extension('PorterStemmer',
+                    sources = ['porter_stemmer.cpp', 'porter_stemmer_core.cpp'],
+                    depends = ['porter_stemmer.h', 'porter_stemmer_capi.h',
+                               'porter_stemmer_internal.h'])
 
 setup (name = 'PorterStemmer',
         version = '1.0',
         description = 'Faster implementation of PorterStemmer',
         ext_modules = [module1],
+        headers = ['porter_stemmer_capi.h'],
+        python_requires = '>=3.7',
         author = 'Keith Bussell')
@@ -0,0 +1,172 @@
+/*  $KB: the command line stemmer, as in the original release: it copies its
+    input to stdout with every word replaced by its stem. A word is a run of
+    ascii letters and digits (porter_word_char(), as for stem_text()), lower
+    cased as it is read, plus any bytes past ascii so that a UTF-8 word is
+    stemmed whole (those bytes count as consonants); all other bytes go
+    through untouched. Since newlines are kept, a one word per line
+    file comes out as one stem per line.
+
+        stem [-p] [file ...]
+
+    reads the files in turn, or stdin if there are none; -p only strips
+    plurals. A regular file is mapped in whole, anything else is read in
+    CLI_CHUNK sized blocks, carrying a word cut off at the end of a block
+    over to the next one. Output is gathered and written in blocks too.
+
+    It only needs the kernel; 'make stem' links it against
+    libporterstemmer.a. */
+
+#include <stdio.h>
+#include <stdlib.h>  /* for exit */
+#include <string.h>  /* for strcmp, memmove */
+#include <vector>
+
+#include "porter_stemmer.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define CLI_MMAP 1
+#endif
+
+#define CLI_CHUNK (1 << 20)
+
+struct cli_state
+{
+    std::vector<unsigned char> word;
+    std::vector<char> out;
+    int plurals_only;
+};
+
+static inline bool cli_word_char(unsigned char ch)
+{
+    return ch >= 0x80 || porter_word_char(ch);
+}
+
+static void cli_flush(cli_state* p_state)
+{
+    if (!p_state->out.empty() &&
+        fwrite(p_state->out.data(), 1, p_state->out.size(), stdout) != p_state->out.size())
+    {
+        perror("stem: write");
+        exit(1);
+    }
+    p_state->out.clear();
+}
+
+/*  cli_stem(p_state, p, len) stems p[0] ... p[len-1] to the output. A word
+    running up to the end is taken as complete, so a caller reading blocks
+    holds back a partial one. */
+
+static void cli_stem(cli_state* p_state, const unsigned char* p, size_t len)
+{
+    size_t pos = 0;
+    while (pos < len)
+    {
+        size_t start = pos;
+        while (pos < len && !cli_word_char(p[pos]))
+            ++pos;
+        p_state->out.insert(p_state->out.end(), p + start, p + pos);
+
+        start = pos;
+        while (pos < len && cli_word_char(p[pos]))
+            ++pos;
+        size_t word_len = pos - start;
+        if (word_len > 0)
+        {
+            p_state->word.resize(word_len);
+            for ( size_t i = 0; i < word_len; ++i )
+            {
+                unsigned char ch = p[start + i];
+                p_state->word[i] = ((unsigned)(ch - 'A') < 26) ? (ch | 0x20) : ch;
+            }
+            word_len = porter::stem_in_place(p_state->word.data(), word_len, p_state->plurals_only);
+            p_state->out.insert(p_state->out.end(), p_state->word.begin(), p_state->word.begin() + word_len);
+        }
+        if (p_state->out.size() >= CLI_CHUNK)
+            cli_flush(p_state);
+    }
+}
+
+static bool cli_stem_mapped(cli_state* p_state, FILE* p_file)
+{
+#ifdef CLI_MMAP
+    struct stat st;
+    int fd = fileno(p_file);
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+        return false;
+    void* p_map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p_map == MAP_FAILED)
+        return false;
+    madvise(p_map, (size_t)st.st_size, MADV_SEQUENTIAL);
+    cli_stem(p_state, (const unsigned char*)p_map, (size_t)st.st_size);
+    munmap(p_map, (size_t)st.st_size);
+    return true;
+#else
+    return false;
+#endif
+}
+
+static void cli_stem_file(cli_state* p_state, FILE* p_file, const char* name)
+{
+    if (cli_stem_mapped(p_state, p_file))
+        return;
+
+    std::vector<unsigned char> buf(CLI_CHUNK);
+    size_t kept = 0;    /* a partial word carried over from the last block */
+    while (true)
+    {
+        if (kept == buf.size())
+            buf.resize(2 * buf.size());
+        size_t got = fread(buf.data() + kept, 1, buf.size() - kept, p_file);
+        size_t len = kept + got;
+        if (got == 0)
+        {
+            if (ferror(p_file))
+            {
+                fprintf(stderr, "stem: error reading %s\n", name);
+                exit(1);
+            }
+            cli_stem(p_state, buf.data(), len);
+            return;
+        }
+
+        size_t end = len;
+        while (end > 0 && cli_word_char(buf[end - 1]))
+            --end;
+        cli_stem(p_state, buf.data(), end);
+        kept = len - end;
+        memmove(buf.data(), buf.data() + end, kept);
+    }
+}
+
+int main(int argc, char * argv[])
+{
+    cli_state state;
+    state.plurals_only = 0;
+
+    int arg = 1;
+    if (arg < argc && strcmp(argv[arg], "-p") == 0)
+    {
+        state.plurals_only = 1;
+        ++arg;
+    }
+
+    if (arg == argc)
+        cli_stem_file(&state, stdin, "stdin");
+    for ( ; arg < argc; ++arg )
+    {
+        FILE* p_file = fopen(argv[arg], "rb");
+        if (p_file == NULL)
+        {
+            fprintf(stderr, "stem: can't open %s\n", argv[arg]);
+            return 1;
+        }
+        cli_stem_file(&state, p_file, argv[arg]);
+        fclose(p_file);
+    }
+    cli_flush(&state);
+    return 0;
+}
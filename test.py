@@ -1,18 +1,93 @@
-from PorterStemmer import stem, set_stopwords
+from PorterStemmer import stem, stem_many, set_stopwords
 
 def test(word):
-    print "%s -> %s" % (word, stem(word))
+    print("%s -> %s" % (word, stem(word)))
 
-test(u'whipped')
-test(u'whipping')
-test(u'halves')
-set_stopwords([u'whipped'])
-test(u'whipped')
-test(u'whipping')
-test(u'halves')
-set_stopwords([u'whipped'])
-print stem(u'whipped')
-print stem(u'whipping')
-set_stopwords([u'whipped', u'whipping'])
-print stem(u'whipped')
-print stem(u'whipping')
+test('whipped')
+test('whipping')
+test('halves')
+set_stopwords(['whipped'])
+test('whipped')
+test('whipping')
+test('halves')
+set_stopwords(['whipped'])
+print(stem('whipped'))
+print(stem('whipping'))
+set_stopwords(['whipped', 'whipping'])
+print(stem('whipped'))
+print(stem('whipping'))
+print(stem_many(['whipped', 'whipping', 'halves']))
+print(stem_many(('ponies', 'caresses'), 1))
+words = ['whipped', 'whipping', 'halves', 'caresses', 'ponies'] * 1000
+print(stem_many(words, 0, 4) == stem_many(words))
+import threading
+words = ['generalizations%d' % i for i in range(200000)]
+clearer = threading.Thread(target=words.clear)
+clearer.start()
+print(len(stem_many(words, 0, 4)) in (0, 200000))
+clearer.join()
+from PorterStemmer import set_cache_size, cache_info, cache_clear
+set_cache_size(1000)
+print(stem('halves'), stem('halves'), stem('halves', 1))
+print(sorted(cache_info().items()))
+cache_clear()
+print(sorted(cache_info().items()))
+class Word(str):
+    def __del__(self):
+        words.clear()
+words = ['ponies', 'hopping', 'runs']
+set_cache_size(1)
+stem(Word('running'))
+print(stem_many(words), words)
+print(repr(stem(b'whipping')), repr(stem_many([b'halves', 'halves'])))
+word, stopword = 'run', 'whipping'
+print(stem(word) is word, stem(stopword) is stopword, stem_many([word])[0] is word)
+long_word = 'hopefulness' * 30
+print(len(stem(long_word)), stem(long_word)[-8:], stem_many([long_word, 'x' * 300 + 'ies'], 0, 2)[1][-4:])
+print(stem('caf\xe9s'), stem('łódźes'), stem('\U0001d4b7ies'), stem_many(['caf\xe9s', '\U0001d4b7ies'], 0, 2))
+from PorterStemmer import stem_hashes
+hashes = stem_hashes(['running', 'run', b'run', 'runner'], 42)
+print(len(hashes), hashes[0] == hashes[1] == hashes[2], hashes[0] != hashes[3], memoryview(hashes).format)
+print(list(stem_hashes(['running'], 1)) != list(stem_hashes(['running'], 2)), stem_hashes(['hopeful', 'hope'], 7, 1)[0] != stem_hashes(['hope'], 7)[0])
+from PorterStemmer import Vocabulary
+vocab = Vocabulary()
+print(list(vocab.add(['running', 'runs', 'caresses', b'run'])), list(vocab.add(['ponies', 'runner', 'run'])))
+print(len(vocab), [vocab.stem(i) for i in range(len(vocab))], list(vocab.doc_freq()), vocab.num_documents())
+print(list(vocab.lookup(['caress', 'pony', 'unseen'])), memoryview(vocab.add([])).format, vocab.num_documents())
+from PorterStemmer import bag_of_words
+indptr, indices, counts, vocab = bag_of_words([['cats', 'running', 'cat', 'whipping'], [], ['runs', 'ponies']])
+print(list(indptr), list(indices), list(counts), [vocab.stem(i) for i in range(len(vocab))], list(vocab.doc_freq()))
+def clearing_doc():
+    docs.clear()
+    yield 'ponies'
+docs = [['cats'], clearing_doc(), ['hopping']]
+print(list(bag_of_words(docs)[0]), docs)
+from PorterStemmer import stem_text
+print(stem_text('The Whipping of caresses, 42 PONIES -- running!'), stem_text(b'Hopeful  runners...', True))
+print(repr(stem_text('Na\xefve caf\xe9s—\U0001d4b7ies are GENERALIZATIONS', join=True)))
+from PorterStemmer import _C_API
+print(type(_C_API).__name__)
+from PorterStemmer import add_stopwords, remove_stopwords
+print(stem('runs'), add_stopwords(['runs', 'whipping']), stem('runs'), stem(b'runs'), remove_stopwords(('whipping', 'unseen')), stem('whipping'))
+import os, tempfile
+from PorterStemmer import load_stopwords, save_stopwords
+path = os.path.join(tempfile.mkdtemp(), 'stopwords')
+with open(path, 'w', encoding='utf-8') as f:
+    f.write('runs\n\ncaf\xe9s\n')
+print(load_stopwords(path), stem('runs'), save_stopwords(path), set_stopwords([]), stem('runs'), load_stopwords(path), stem('caf\xe9s'))
+import struct
+with open(path, 'wb') as f:
+    # a 4 code point arena with a slot at offset 3, whose length runs past it
+    f.write(struct.pack('=8sIIQQQQ', b'PSTOPWD\0', 1, 0x01020304, 2, 48, 4, 64))
+    f.write(struct.pack('=QQ4I', 3, 0xffffffff, 0, 0, 0, 0xfffffff0))
+try:
+    load_stopwords(path)
+except ValueError:
+    print('corrupt image rejected', stem('caf\xe9s'))
+print(stem_many(['ponies', 'hopping'], plurals_only=1, threads=2), list(stem_hashes(['runs'], seed=7)) == list(stem_hashes(['runs'], 7)), list(bag_of_words(documents=[['cats']], plurals_only=1)[0]))
+vocab = Vocabulary()
+for call in (lambda: bag_of_words(['hello world'], vocab), lambda: bag_of_words([['cats'], ['ponies', 3]], vocab), lambda: vocab.add(['hopping', None])):
+    try:
+        call()
+    except TypeError:
+        print(len(vocab), list(vocab.doc_freq()), list(vocab.add(['cats'])))